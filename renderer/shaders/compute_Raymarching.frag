@@ -3,8 +3,19 @@
 layout(location = 0) in vec2 uv;
 layout(location = 0) out vec4 outColor;
 
+// Start of the UniformBufferObject of basic_Raymarching.comp
+layout(set = 0, binding = 0, std140) uniform UniformBufferObject
+{
+    vec4 settings1;
+    vec4 settings2;
+    vec4 settings3; // yz = render size, the top left part of img_output written by the compute pass
+} ubo;
+
 layout(binding = 1) uniform sampler2D img_output;
 
 void main() {
-    outColor = texture(img_output, uv);
+    // Kept half a texel inside the render size, the filter would blend in the rest of the image
+    vec2 renderSize = ubo.settings3.yz;
+    vec2 texel = clamp(uv * renderSize, vec2(0.5), renderSize - 0.5);
+    outColor = texture(img_output, texel / vec2(textureSize(img_output, 0)));
 }
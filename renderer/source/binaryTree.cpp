@@ -2,8 +2,178 @@
 
 #include <vector>
 #include <iostream>
+#include <stdexcept>
+#include <algorithm>
 
+#include <atomic>
 #include <bitset>
+#include <bit>
+#include <limits>
+#include <memory>
+#include <mutex>
+
+#include "radix_sort.h"
+#include "work_stealing_pool.h"
+
+// Leaf distance kernels: AVX2 when the build targets it (SIMD_AVX2 option), SSE2 on any x64, NEON on arm64
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define POINT_KERNEL_AVX2
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define POINT_KERNEL_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define POINT_KERNEL_NEON
+#endif
+
+namespace
+{
+   // 10 bits per axis -> 30 bits Morton codes, packed above a 32 bits point index in the sort keys
+   constexpr int MORTON_BITS_PER_AXIS = 10;
+   constexpr uint32_t MORTON_GRID_SIZE = uint32_t(1) << MORTON_BITS_PER_AXIS;
+   constexpr int MORTON_KEY_SHIFT = 32;
+
+   // Spreads the low 10 bits of value so that two zero bits sit between each of them
+   uint32_t ExpandBits(uint32_t value)
+   {
+      value &= MORTON_GRID_SIZE - 1;
+      value = (value | value << 16) & 0x030000ffu;
+      value = (value | value << 8) & 0x0300f00fu;
+      value = (value | value << 4) & 0x030c30c3u;
+      value = (value | value << 2) & 0x09249249u;
+      return value;
+   }
+
+   constexpr int MAX_SAH_BINS = 64;
+   constexpr int MAX_MEDIAN_BINS = 256;
+
+   // Left uninitialized in arrays, only the bins in use are reset (EMPTY_SAH_BIN)
+   struct SAHBin
+   {
+      glm::vec3 min;
+      glm::vec3 max;
+      size_t count;
+   };
+
+   const SAHBin EMPTY_SAH_BIN = { glm::vec3(std::numeric_limits<float>::max()), glm::vec3(-std::numeric_limits<float>::max()), 0 };
+
+   // Half the surface area of a box of this size once grown by radius on every side
+   float HalfArea(glm::vec3 size, float radius)
+   {
+      size += glm::vec3(2 * radius);
+      return size.x * size.y + size.y * size.z + size.z * size.x;
+   }
+
+   // cell is a position in the quantization grid, [0, MORTON_GRID_SIZE) on every axis
+   uint32_t MortonCode(glm::vec3 cell)
+   {
+      cell = glm::clamp(cell, glm::vec3(0), glm::vec3(static_cast<float>(MORTON_GRID_SIZE - 1)));
+      return (ExpandBits(static_cast<uint32_t>(cell.x)) << 2) | (ExpandBits(static_cast<uint32_t>(cell.y)) << 1) |
+             ExpandBits(static_cast<uint32_t>(cell.z));
+   }
+
+#if defined(POINT_KERNEL_AVX2)
+   constexpr int POINT_KERNEL_LANES = 8;
+#elif defined(POINT_KERNEL_SSE2) || defined(POINT_KERNEL_NEON)
+   constexpr int POINT_KERNEL_LANES = 4;
+#else
+   constexpr int POINT_KERNEL_LANES = 1;
+#endif
+
+   // Every builder stops at MAX_POINTS_PER_LEAVES points per leaf, rounded up to whole vectors
+   constexpr int LEAF_DISTANCE_SLOTS = (MAX_POINTS_PER_LEAVES + POINT_KERNEL_LANES - 1) / POINT_KERNEL_LANES * POINT_KERNEL_LANES;
+
+   // Squared distances from point to the count points starting at x, y, z (SoA), written in out[0, count).
+   // Whole vectors are computed: the arrays are padded so the last one never reads past their end,
+   // and out needs LEAF_DISTANCE_SLOTS floats.
+   void LeafDistancesSqr(const float *x, const float *y, const float *z, int count, glm::vec3 point, float *out)
+   {
+#if defined(POINT_KERNEL_AVX2)
+      const __m256 pointX = _mm256_set1_ps(point.x);
+      const __m256 pointY = _mm256_set1_ps(point.y);
+      const __m256 pointZ = _mm256_set1_ps(point.z);
+      for (int i = 0; i < count; i += POINT_KERNEL_LANES)
+      {
+         const __m256 diffX = _mm256_sub_ps(_mm256_loadu_ps(x + i), pointX);
+         const __m256 diffY = _mm256_sub_ps(_mm256_loadu_ps(y + i), pointY);
+         const __m256 diffZ = _mm256_sub_ps(_mm256_loadu_ps(z + i), pointZ);
+         const __m256 distSqr = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(diffX, diffX), _mm256_mul_ps(diffY, diffY)),
+                                              _mm256_mul_ps(diffZ, diffZ));
+         _mm256_storeu_ps(out + i, distSqr);
+      }
+#elif defined(POINT_KERNEL_SSE2)
+      const __m128 pointX = _mm_set1_ps(point.x);
+      const __m128 pointY = _mm_set1_ps(point.y);
+      const __m128 pointZ = _mm_set1_ps(point.z);
+      for (int i = 0; i < count; i += POINT_KERNEL_LANES)
+      {
+         const __m128 diffX = _mm_sub_ps(_mm_loadu_ps(x + i), pointX);
+         const __m128 diffY = _mm_sub_ps(_mm_loadu_ps(y + i), pointY);
+         const __m128 diffZ = _mm_sub_ps(_mm_loadu_ps(z + i), pointZ);
+         const __m128 distSqr = _mm_add_ps(_mm_add_ps(_mm_mul_ps(diffX, diffX), _mm_mul_ps(diffY, diffY)), _mm_mul_ps(diffZ, diffZ));
+         _mm_storeu_ps(out + i, distSqr);
+      }
+#elif defined(POINT_KERNEL_NEON)
+      const float32x4_t pointX = vdupq_n_f32(point.x);
+      const float32x4_t pointY = vdupq_n_f32(point.y);
+      const float32x4_t pointZ = vdupq_n_f32(point.z);
+      for (int i = 0; i < count; i += POINT_KERNEL_LANES)
+      {
+         const float32x4_t diffX = vsubq_f32(vld1q_f32(x + i), pointX);
+         const float32x4_t diffY = vsubq_f32(vld1q_f32(y + i), pointY);
+         const float32x4_t diffZ = vsubq_f32(vld1q_f32(z + i), pointZ);
+         vst1q_f32(out + i, vmlaq_f32(vmlaq_f32(vmulq_f32(diffX, diffX), diffY, diffY), diffZ, diffZ));
+      }
+#else
+      for (int i = 0; i < count; i++)
+      {
+         const glm::vec3 diff = glm::vec3(x[i], y[i], z[i]) - point;
+         out[i] = dot(diff, diff);
+      }
+#endif
+   }
+
+   // Squared distance from point to the closest point of the node box, 0 inside
+   float DistanceSqrToBox(const Node &node, glm::vec3 point)
+   {
+      const glm::vec3 outside = glm::max(glm::max(node.boxPos - point, point - (node.boxPos + node.boxSize)), glm::vec3(0));
+      return dot(outside, outside);
+   }
+
+   // Squared distance from point to the farthest corner of the node box
+   float FarthestDistanceSqrInBox(const Node &node, glm::vec3 point)
+   {
+      const glm::vec3 farthest = glm::max(glm::abs(point - node.boxPos), glm::abs(node.boxPos + node.boxSize - point));
+      return dot(farthest, farthest);
+   }
+
+   // How much the surface of the node box grows to take point in
+   float AreaGrowth(const Node &node, glm::vec3 point)
+   {
+      const glm::vec3 size = glm::max(node.boxPos + node.boxSize, point) - glm::min(node.boxPos, point);
+      return HalfArea(size, 0) - HalfArea(node.boxSize, 0);
+   }
+
+   // Changed entries closer than this are uploaded as one range
+   constexpr size_t RANGE_MERGE_GAP = 4;
+
+   // Sorts indices and turns them into [first, last) ranges, indices is cleared
+   template <typename Index>
+   void MergeIntoRanges(std::vector<Index> &indices, std::vector<IndexRange> &ranges)
+   {
+      std::sort(indices.begin(), indices.end());
+      for (const Index index : indices)
+      {
+         const size_t i = static_cast<size_t>(index);
+         if (!ranges.empty() && i <= ranges.back().last + RANGE_MERGE_GAP)
+            ranges.back().last = std::max(ranges.back().last, i + 1);
+         else
+            ranges.push_back({ i, i + 1 });
+      }
+      indices.clear();
+   }
+}
 
 
 std::vector<glm::vec3> FakeDataGenerator(int numberOfValues = 3, float min, float max)
@@ -28,34 +198,147 @@ std::vector<glm::vec3> FakeDataGenerator(int numberOfValues = 3, float min, floa
    return toReturn;
 }
 
-BinaryTree::BinaryTree(std::vector<glm::vec3> &pointCloudPoints)
+BinaryTree::BinaryTree(std::vector<glm::vec3> &pointCloudPoints, const BinaryTreeBuildSettings &buildSettings)
+   : m_buildSettings(buildSettings)
 {
    generatedPoints = pointCloudPoints;
 
+   if (pointCloudPoints.empty())
+      return;
+
    // Get generation
    // int generation = 0;
    // while (pow(2, generation) < pointCloudPoints.size() / MAX_POINTS_PER_LEAVES)
    //    generation++;
 
-   int generation = std::ceil(std::log2(pointCloudPoints.size() / static_cast<double>(MAX_POINTS_PER_LEAVES)));
+   CheckTreeDepth(pointCloudPoints.size());
 
    //std::cout << "Elements : " << pointCloudPoints.size() << ", Gen : " << generation << std::endl;
 
-   // Create architecture from generation
-   Node *root = new Node();
-   root->slice = 0;
-   root->boxPos = glm::vec3(0, 0, 0);
-   root->boxSize = glm::vec3(0, 0, 0);
-   root->left = nullptr;
-   root->right = nullptr;
-   // root->generation = 0;
-   CreateStructureNodes(0, generation, root, 1);
+   m_phaseStart = std::chrono::steady_clock::now();
+
+   std::unique_ptr<WorkStealingPool> pool;
+   if (m_buildSettings.threadCount != 1)
+   {
+      pool = std::make_unique<WorkStealingPool>(m_buildSettings.threadCount);
+      m_pool = pool.get();
+      EndBuildPhase("thread pool");
+   }
+
+   if (m_buildSettings.builder == TREE_BUILDER_LBVH)
+      BuildLBVH();
+   else if (m_buildSettings.builder == TREE_BUILDER_SAH)
+      BuildSAH();
+   else
+      BuildMedianSplit();
+
+   m_pool = nullptr;
+
+   // view tree
+   // PrintNodeRecursive(ROOT_INDEX);
+
+   // Node* result =  GetNodeFromMorton(6, root);
+   // PrintNode(result);
+
+   // glm::vec3* pointsArray = FillGPUPointsArray();
+
+   m_pointCount = generatedPoints.size();
+   FillGPUArrays();
+   EndBuildPhase("GPU arrays");
+
+   m_builtCost = GetTreeCost();
+
+   std::cout << "GPU buffer nodes : " << GPUReadyBuffer.size() << ", points : " << GPUReadyPoints.size() << std::endl;
+   //for (int i = 0; i < GPUReadyBuffer.size(); i++)
+   //{
+   //    std::cout << "Children : " << GPUReadyBuffer[i].children.x << ", " << GPUReadyBuffer[i].children.x << ", ";
+   //    std::cout << "BoxPos : " << GPUReadyBuffer[i].boxPos.x << ", " << GPUReadyBuffer[i].boxPos.y << ", " << GPUReadyBuffer[i].boxPos.z << ", ";
+   //    std::cout << "BoxSize : " << GPUReadyBuffer[i].boxSize.x << ", " << GPUReadyBuffer[i].boxSize.y << ", " << GPUReadyBuffer[i].boxSize.z << ", ";
+
+   //    std::cout << std::endl;
+
+   //    //if (i == 2525)
+   //    //    for (int j = 0; j < 16; j++)
+   //    //    {
+   //    //        std::cout << "x:" << GPUReadyBuffer[i].cloudPoints[j].x << "y:" << GPUReadyBuffer[i].cloudPoints[j].y << "z:" << GPUReadyBuffer[i].cloudPoints[j].z << std::endl;
+   //    //    }
+   //}
+}
+
+void BinaryTree::EndBuildPhase(const char *name)
+{
+   const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+   m_buildPhases.push_back({ name, std::chrono::duration<float, std::milli>(now - m_phaseStart).count() });
+   m_phaseStart = now;
+}
+
+void BinaryTree::FillGPUArrays()
+{
+   GPUReadyBuffer.resize(m_nodes.size());
+   for (size_t i = 0; i < m_nodes.size(); i++)
+      WriteGPUNode(static_cast<int>(i));
+
+   // Leaves own contiguous ranges of the built points, they go as they are
+   GPUReadyPoints.resize(generatedPoints.size());
+   for (size_t i = 0; i < generatedPoints.size(); i++)
+      GPUReadyPoints[i] = glm::vec4(generatedPoints[i], 1);
+
+   // Query copy, one array per axis
+   for (std::vector<float> *axisPoints : { &m_pointsX, &m_pointsY, &m_pointsZ })
+      axisPoints->assign(generatedPoints.size() + SOA_PADDING, std::numeric_limits<float>::max());
+   for (size_t i = 0; i < generatedPoints.size(); i++)
+   {
+      m_pointsX[i] = generatedPoints[i].x;
+      m_pointsY[i] = generatedPoints[i].y;
+      m_pointsZ[i] = generatedPoints[i].z;
+   }
+}
+
+void BinaryTree::WriteGPUNode(int nodeIndex)
+{
+   const Node &node = m_nodes[nodeIndex];
+   GPUNode &gpuNode = GPUReadyBuffer[nodeIndex];
+
+   gpuNode.boxPos = glm::vec4(node.boxPos, -1);
+   gpuNode.boxSize = glm::vec4(node.boxSize, -1);
+
+   // Arena indices are GPU indices, a leaf reuses the left slot for its first point
+   const bool isLeaf = node.pointCount > 0;
+   gpuNode.children.x = isLeaf ? node.pointOffset : node.left;
+   gpuNode.children.y = node.right;
+
+   // skip past the last node -> end of traversal
+   gpuNode.children.z = node.skipIndex < static_cast<int>(m_nodes.size()) ? node.skipIndex : 0;
+   gpuNode.children.w = node.pointCount;
+
+   if (!m_depthFirst)
+      m_changedNodes.push_back(nodeIndex);
+}
+
+int BinaryTree::GetGeneration(size_t pointCount)
+{
+   // Clamped to 1 for the clouds that fit in a single leaf
+   return std::max(1, static_cast<int>(std::ceil(std::log2(pointCount / static_cast<double>(MAX_POINTS_PER_LEAVES)))));
+}
+
+void BinaryTree::CheckTreeDepth(size_t pointCount)
+{
+   if (GetGeneration(pointCount) > MAX_TREE_DEPTH)
+      throw std::runtime_error("Point cloud too large: tree would exceed MAX_TREE_DEPTH generations");
+}
+
+void BinaryTree::BuildMedianSplit()
+{
+   // Allocate every node at once, in GPU order
+   m_nodes.resize(ROOT_INDEX + GetSubtreeNodeCount(generatedPoints.size()));
+   Node &root = m_nodes[ROOT_INDEX];
 
    // Get root box
-   std::vector<glm::vec3> rootbox = GetBox(pointCloudPoints);
+   std::array<glm::vec3, 2> rootbox = GetBox(0, generatedPoints.size());
 
-   root->boxPos = rootbox[0];
-   root->boxSize = rootbox[1];
+   root.boxPos = rootbox[0];
+   root.boxSize = rootbox[1];
+   EndBuildPhase("root box");
 
    //
    // std::vector<float> min = {pointCloudPoints[0].x, pointCloudPoints[0].y, pointCloudPoints[0].z};
@@ -77,106 +360,382 @@ BinaryTree::BinaryTree(std::vector<glm::vec3> &pointCloudPoints)
    // std::cout << "Box corner : [" << root->boxPos[0] << ", " << root->boxPos[1] << ", " << root->boxPos[2] <<
    //       "], size : [" << root->boxSize[0] << ", " << root->boxSize[1] << ", " << root->boxSize[2] << "]" << std::endl;
 
+   // Scratch for the binned and the parallel selections, concurrent selections work on disjoint ranges of it
+   const bool parallelSplits = m_pool != nullptr && generatedPoints.size() > m_buildSettings.parallelSplitCutoff;
+   const bool binnedSplits = m_buildSettings.medianBinCount > 1 && generatedPoints.size() > m_buildSettings.binnedSplitCutoff;
+   if (parallelSplits || binnedSplits)
+      m_scratchPoints.resize(generatedPoints.size());
+
    // Give values for structure nodes
-   FillUpTreeRecursive(pointCloudPoints, root, 0);
+   if (m_pool == nullptr)
+   {
+      FillUpTreeRecursive(0, generatedPoints.size(), ROOT_INDEX, 0, nullptr);
+      m_scratchPoints = std::vector<glm::vec3>();
+      EndBuildPhase("median splits");
+      return;
+   }
 
-   // view tree
-   // PrintNodeRecursive(root);
+   TaskGroup group(*m_pool);
+   FillUpTreeRecursive(0, generatedPoints.size(), ROOT_INDEX, 0, &group);
+   group.Wait();
 
-   // Node* result =  GetNodeFromMorton(6, root);
-   // PrintNode(result);
+   m_scratchPoints = std::vector<glm::vec3>();
+   EndBuildPhase("median splits");
+}
 
-   glm::vec3 nearestPoint = GetNearestPoint(glm::vec3(50, 50, 50), 1, 0, root);
+void BinaryTree::BuildLBVH()
+{
+   const size_t pointCount = generatedPoints.size();
+   if (pointCount > UINT32_MAX)
+      throw std::runtime_error("Point cloud too large for the LBVH builder");
+
+   // Quantize in the cube around the cloud, so that a Morton bit cuts space evenly on every axis
+   std::array<glm::vec3, 2> box = GetBox(0, pointCount);
+   const float extent = std::max({ box[1].x, box[1].y, box[1].z, 1e-20f });
+   const float scale = static_cast<float>(MORTON_GRID_SIZE - 1) / extent;
+
+   // Key = code << 32 | point index, only the code bits are sorted
+   std::vector<uint64_t> keys(pointCount);
+   ForRange(0, pointCount, [&](size_t rangeBegin, size_t rangeEnd)
+   {
+      for (size_t i = rangeBegin; i < rangeEnd; i++)
+         keys[i] = (static_cast<uint64_t>(MortonCode((generatedPoints[i] - box[0]) * scale)) << MORTON_KEY_SHIFT) | i;
+   });
+   EndBuildPhase("Morton codes");
+
+   RadixSort(keys, MORTON_KEY_SHIFT, MORTON_KEY_SHIFT + 3 * MORTON_BITS_PER_AXIS, m_pool);
+   EndBuildPhase("radix sort");
+
+   // Points in Morton order: every subtree owns a contiguous range
+   std::vector<uint32_t> codes(pointCount);
+   m_scratchPoints.resize(pointCount);
+   ForRange(0, pointCount, [&](size_t rangeBegin, size_t rangeEnd)
+   {
+      for (size_t i = rangeBegin; i < rangeEnd; i++)
+      {
+         codes[i] = static_cast<uint32_t>(keys[i] >> MORTON_KEY_SHIFT);
+         m_scratchPoints[i] = generatedPoints[keys[i] & UINT32_MAX];
+      }
+   });
+   keys = std::vector<uint64_t>();
+   generatedPoints.swap(m_scratchPoints);
+   m_scratchPoints = std::vector<glm::vec3>();
+   EndBuildPhase("point reorder");
+
+   // Index 0 stays unused, the subtree of the whole cloud starts at ROOT_INDEX
+   m_nodes.clear();
+   m_nodes.reserve(ROOT_INDEX + 4 * (pointCount / MAX_POINTS_PER_LEAVES + 1));
+   m_nodes.resize(ROOT_INDEX);
+   EmitLBVHRecursive(codes, 0, pointCount, 0);
+   EndBuildPhase("hierarchy");
+}
 
+int BinaryTree::EmitLBVHRecursive(const std::vector<uint32_t> &codes, size_t first, size_t last, int deepness)
+{
+   const int nodeIndex = static_cast<int>(m_nodes.size());
+   m_nodes.emplace_back();
 
-   //std::cout << "nearestPoint : " << nearestPoint[0] << ", " << nearestPoint[1] << ", " << nearestPoint[2] << std::endl;
+   if (last - first <= MAX_POINTS_PER_LEAVES)
+   {
+      Node &leaf = m_nodes[nodeIndex];
 
-   // glm::vec3* pointsArray = FillGPUPointsArray();
+      std::array<glm::vec3, 2> box = GetBox(first, last);
+      leaf.boxPos = box[0];
+      leaf.boxSize = box[1];
 
-   std::vector<Node> buffer = FillGPUArray(root, pointCloudPoints);
+      leaf.pointOffset = static_cast<int>(first);
+      leaf.pointCount = static_cast<int>(last - first);
+      leaf.skipIndex = nodeIndex + 1;
+      return nodeIndex;
+   }
 
-   // std::cout << "Buffer morton: " << buffer.size() << std::endl;
-   // for (int i = 0; i < buffer.size(); i++)
-   // {
-   //    std::cout << buffer[i].mortonNumber << ", ";
-   // }
+   const size_t split = FindMortonSplit(codes, first, last, deepness);
 
-   //std::cout << std::endl;
-   // std::cout << "Buffer points: " << buffer.size() << std::endl;
-   // for (int i = 0; i < buffer.size(); i++)
-   // {
-   //    for (int j = 0; j < MAX_POINTS_PER_LEAVES; j++)
-   //       std::cout << buffer.data()[i].cloudPoints[j].x << ", " << buffer.data()[i].cloudPoints[j].y << ", " << buffer.
-   //             data()[i].cloudPoints[j].z << std::endl;
-   //    std::cout << std::endl;
-   // }
+   const int left = EmitLBVHRecursive(codes, first, split, deepness + 1);
+   const int right = EmitLBVHRecursive(codes, split, last, deepness + 1);
 
-   GPUReadyBuffer.resize(buffer.size());
-   for (int i = 0; i < buffer.size(); i++)
-   {
-      // Unchanged
-       GPUReadyBuffer[i].boxPos = glm::vec4(buffer[i].boxPos, -1);
-      GPUReadyBuffer[i].boxSize = glm::vec4(buffer[i].boxSize, -1);
+   // The arena may have grown, only take the reference now
+   Node &node = m_nodes[nodeIndex];
+   node.left = left;
+   node.right = right;
+   node.skipIndex = static_cast<int>(m_nodes.size());
+
+   // Fitted box around both children
+   const glm::vec3 minCorner = glm::min(m_nodes[left].boxPos, m_nodes[right].boxPos);
+   const glm::vec3 maxCorner = glm::max(m_nodes[left].boxPos + m_nodes[left].boxSize, m_nodes[right].boxPos + m_nodes[right].boxSize);
+   node.boxPos = minCorner;
+   node.boxSize = maxCorner - minCorner;
+
+   return nodeIndex;
+}
 
-      for(int j =0; j < 15; j++)
-        GPUReadyBuffer[i].cloudPoints[j] = glm::vec4(buffer[i].cloudPoints[j], -1);
+size_t BinaryTree::FindMortonSplit(const std::vector<uint32_t> &codes, size_t first, size_t last, int deepness)
+{
+   const size_t count = last - first;
+
+   if (codes[first] == codes[last - 1] || deepness + GetGeneration(count) >= MAX_TREE_DEPTH)
+      return first + (count + 1) / 2;
+
+   // Codes are sorted and share every bit above the highest differing one:
+   // the split is the first code with that bit set
+   const uint32_t bit = uint32_t(1) << (31 - std::countl_zero(codes[first] ^ codes[last - 1]));
+   std::vector<uint32_t>::const_iterator split = std::partition_point(codes.begin() + first, codes.begin() + last,
+                                                                      [bit](uint32_t code) { return (code & bit) == 0; });
+
+   return static_cast<size_t>(split - codes.begin());
+}
+
+void BinaryTree::BuildSAH()
+{
+   const size_t pointCount = generatedPoints.size();
+
+   // Index 0 stays unused, the subtree of the whole cloud starts at ROOT_INDEX
+   m_nodes.clear();
+   m_nodes.reserve(ROOT_INDEX + 4 * (pointCount / MAX_POINTS_PER_LEAVES + 1));
+   m_nodes.resize(ROOT_INDEX);
+   EmitSAHRecursive(0, pointCount, GetBox(0, pointCount), 0);
+   EndBuildPhase("SAH splits");
+}
 
-      // left/right -> int index
-       if (buffer[i].left != nullptr)
-          GPUReadyBuffer[i].children.x = buffer[i].left->mortonNumber;
-       else
-          GPUReadyBuffer[i].children.x = 0;
+int BinaryTree::EmitSAHRecursive(size_t first, size_t last, const std::array<glm::vec3, 2> &box, int deepness)
+{
+   const int nodeIndex = static_cast<int>(m_nodes.size());
+   m_nodes.emplace_back();
+
+   const size_t count = last - first;
 
-       if (buffer[i].right != nullptr)
-          GPUReadyBuffer[i].children.y = buffer[i].right->mortonNumber;
-       else
-          GPUReadyBuffer[i].children.y = 0;
+   m_nodes[nodeIndex].boxPos = box[0];
+   m_nodes[nodeIndex].boxSize = box[1];
+
+   std::array<std::array<glm::vec3, 2>, 2> childBoxes;
+   size_t split = first;
+   if (count > MAX_POINTS_PER_LEAVES && deepness + GetGeneration(count) >= MAX_TREE_DEPTH)
+   {
+      // No depth left for unbalanced splits
+      split = SplitByCount(first, last, box, childBoxes);
    }
+   else
+   {
+      float splitCost = 0;
+      split = FindSAHSplit(first, last, box, splitCost, childBoxes);
 
-   std::cout << "GPU buffer nodes : " << GPUReadyBuffer.size() << std::endl;
-   //for (int i = 0; i < GPUReadyBuffer.size(); i++)
-   //{
-   //    std::cout << "Children : " << GPUReadyBuffer[i].children.x << ", " << GPUReadyBuffer[i].children.x << ", ";
-   //    std::cout << "BoxPos : " << GPUReadyBuffer[i].boxPos.x << ", " << GPUReadyBuffer[i].boxPos.y << ", " << GPUReadyBuffer[i].boxPos.z << ", ";
-   //    std::cout << "BoxSize : " << GPUReadyBuffer[i].boxSize.x << ", " << GPUReadyBuffer[i].boxSize.y << ", " << GPUReadyBuffer[i].boxSize.z << ", ";
+      // Small enough to be a leaf, and cheaper as one
+      if (count <= MAX_POINTS_PER_LEAVES && (split == first || count * SAH_POINT_COST <= splitCost))
+      {
+         Node &leaf = m_nodes[nodeIndex];
+         leaf.pointOffset = static_cast<int>(first);
+         leaf.pointCount = static_cast<int>(count);
+         leaf.skipIndex = nodeIndex + 1;
+         return nodeIndex;
+      }
 
-   //    std::cout << std::endl;
+      // Every point in the same spot
+      if (split == first)
+         split = SplitByCount(first, last, box, childBoxes);
+   }
 
-   //    //if (i == 2525)
-   //    //    for (int j = 0; j < 16; j++)
-   //    //    {
-   //    //        std::cout << "x:" << GPUReadyBuffer[i].cloudPoints[j].x << "y:" << GPUReadyBuffer[i].cloudPoints[j].y << "z:" << GPUReadyBuffer[i].cloudPoints[j].z << std::endl;
-   //    //    }
-   //}
+   const int left = EmitSAHRecursive(first, split, childBoxes[0], deepness + 1);
+   const int right = EmitSAHRecursive(split, last, childBoxes[1], deepness + 1);
+
+   // The arena may have grown, only take the reference now
+   Node &node = m_nodes[nodeIndex];
+   node.left = left;
+   node.right = right;
+   node.skipIndex = static_cast<int>(m_nodes.size());
+
+   return nodeIndex;
 }
 
-void BinaryTree::FillGPUArrayRecursive(Node *node, std::vector<glm::vec3> &pointCloudPoints,
-                                       std::vector<Node> &toReturn)
+size_t BinaryTree::FindSAHSplit(size_t first, size_t last, const std::array<glm::vec3, 2> &box, float &cost,
+                                std::array<std::array<glm::vec3, 2>, 2> &childBoxes)
 {
-   if (node->mortonNumber >= toReturn.size())
+   // Small ranges cannot fill many bins, sweeping empty ones is wasted time
+   const int binCount = static_cast<int>(std::clamp<size_t>(std::min<size_t>(m_buildSettings.sahBinCount, (last - first) / 2), 2, MAX_SAH_BINS));
+   const float radius = m_buildSettings.sphereRadius;
+
+   const float parentArea = HalfArea(box[1], radius);
+   if (parentArea <= 0)
+      return first;
+
+   // Bin every point on the three axes at once
+   glm::vec3 binScale;
+   for (int axis = 0; axis < 3; axis++)
+      binScale[axis] = box[1][axis] > 0 ? binCount / box[1][axis] : 0;
+
+   auto getBin = [&box, &binScale, binCount](const glm::vec3 &point, int axis)
    {
-      std::cout << "MORTON BROKEN ALED" << std::endl;
-      return;
+      return std::min(binCount - 1, static_cast<int>((point[axis] - box[0][axis]) * binScale[axis]));
+   };
+
+   using SAHBins = std::array<std::array<SAHBin, MAX_SAH_BINS>, 3>;
+   auto fillBins = [&](size_t rangeBegin, size_t rangeEnd, SAHBins &rangeBins)
+   {
+      for (int axis = 0; axis < 3; axis++)
+         std::fill(rangeBins[axis].begin(), rangeBins[axis].begin() + binCount, EMPTY_SAH_BIN);
+
+      for (size_t i = rangeBegin; i < rangeEnd; i++)
+      {
+         const glm::vec3 &point = generatedPoints[i];
+         for (int axis = 0; axis < 3; axis++)
+         {
+            SAHBin &bin = rangeBins[axis][getBin(point, axis)];
+            bin.min = glm::min(bin.min, point);
+            bin.max = glm::max(bin.max, point);
+            bin.count++;
+         }
+      }
+   };
+
+   SAHBins bins;
+   if (m_pool == nullptr || last - first <= m_buildSettings.sequentialCutoff)
+      fillBins(first, last, bins);
+   else
+   {
+      for (int axis = 0; axis < 3; axis++)
+         std::fill(bins[axis].begin(), bins[axis].begin() + binCount, EMPTY_SAH_BIN);
+
+      std::mutex binsMutex;
+      ForRange(first, last, [&](size_t rangeBegin, size_t rangeEnd)
+      {
+         SAHBins rangeBins;
+         fillBins(rangeBegin, rangeEnd, rangeBins);
+
+         std::lock_guard<std::mutex> lock(binsMutex);
+         for (int axis = 0; axis < 3; axis++)
+         {
+            for (int b = 0; b < binCount; b++)
+            {
+               bins[axis][b].min = glm::min(bins[axis][b].min, rangeBins[axis][b].min);
+               bins[axis][b].max = glm::max(bins[axis][b].max, rangeBins[axis][b].max);
+               bins[axis][b].count += rangeBins[axis][b].count;
+            }
+         }
+      });
    }
-   toReturn[node->mortonNumber] = *node;
 
+   float bestCost = std::numeric_limits<float>::max();
+   int bestAxis = -1;
+   int bestBin = 0;
+   SAHBin bestLeft = EMPTY_SAH_BIN;
+   SAHBin bestRight = EMPTY_SAH_BIN;
+
+   for (int axis = 0; axis < 3; axis++)
+   {
+      if (binScale[axis] == 0)
+         continue;
+
+      // Right to left sweep: everything from bin b to the end
+      std::array<SAHBin, MAX_SAH_BINS> rights;
+      for (int b = binCount - 1; b > 0; b--)
+      {
+         SAHBin &right = rights[b];
+         right = b + 1 < binCount ? rights[b + 1] : EMPTY_SAH_BIN;
 
-   if (node->left != nullptr)
-      FillGPUArrayRecursive(node->left, pointCloudPoints, toReturn);
-   if (node->right != nullptr)
-      FillGPUArrayRecursive(node->right, pointCloudPoints, toReturn);
+         right.min = glm::min(right.min, bins[axis][b].min);
+         right.max = glm::max(right.max, bins[axis][b].max);
+         right.count += bins[axis][b].count;
+      }
+
+      // Left to right sweep: split before bin b
+      SAHBin left = EMPTY_SAH_BIN;
+      for (int b = 1; b < binCount; b++)
+      {
+         left.min = glm::min(left.min, bins[axis][b - 1].min);
+         left.max = glm::max(left.max, bins[axis][b - 1].max);
+         left.count += bins[axis][b - 1].count;
+
+         if (left.count == 0 || left.count == last - first)
+            continue;
+
+         const SAHBin &right = rights[b];
+         const float leftCost = HalfArea(left.max - left.min, radius) * left.count;
+         const float rightCost = HalfArea(right.max - right.min, radius) * right.count;
+         const float splitCost = SAH_NODE_COST + (leftCost + rightCost) / parentArea * SAH_POINT_COST;
+         if (splitCost < bestCost)
+         {
+            bestCost = splitCost;
+            bestAxis = axis;
+            bestBin = b;
+            bestLeft = left;
+            bestRight = right;
+         }
+      }
+   }
+
+   if (bestAxis < 0)
+      return first;
+
+   cost = bestCost;
+   childBoxes = { { { bestLeft.min, bestLeft.max - bestLeft.min }, { bestRight.min, bestRight.max - bestRight.min } } };
+
+   std::vector<glm::vec3>::iterator split = std::partition(generatedPoints.begin() + first, generatedPoints.begin() + last,
+                                                           [&](const glm::vec3 &point) { return getBin(point, bestAxis) < bestBin; });
+
+   return static_cast<size_t>(split - generatedPoints.begin());
 }
 
-std::vector<Node> BinaryTree::FillGPUArray(Node *root, std::vector<glm::vec3> &pointCloudPoints)
+size_t BinaryTree::SplitByCount(size_t first, size_t last, const std::array<glm::vec3, 2> &box,
+                                std::array<std::array<glm::vec3, 2>, 2> &childBoxes)
 {
-   int generation = std::ceil(std::log2(pointCloudPoints.size() / static_cast<double>(MAX_POINTS_PER_LEAVES)));
+   int axis = 0;
+   if (box[1].y > box[1][axis])
+      axis = 1;
+   if (box[1].z > box[1][axis])
+      axis = 2;
+
+   const size_t mid = first + (last - first + 1) / 2;
+   std::nth_element(generatedPoints.begin() + first, generatedPoints.begin() + mid, generatedPoints.begin() + last,
+                    [axis](const glm::vec3 &a, const glm::vec3 &b) { return a[axis] < b[axis]; });
+
+   childBoxes = { GetBox(first, mid), GetBox(mid, last) };
+   return mid;
+}
 
-   std::vector<Node> toReturn;
-   // toReturn.resize(pow(2, generation+1) -1);
-   toReturn.resize((1 << (generation + 1)));
+void BinaryTree::ForRange(size_t first, size_t last, const std::function<void(size_t, size_t)> &function)
+{
+   if (m_pool == nullptr)
+      function(first, last);
+   else
+      m_pool->ParallelFor(first, last, m_buildSettings.sequentialCutoff, function);
+}
 
-   FillGPUArrayRecursive(root, pointCloudPoints, toReturn);
-   return toReturn;
+// Depth-first (pre-order) layout: an internal node's left child is the next node in the array,
+// and its whole subtree ends right before its skip index. The shader walks the tree without a stack
+// by following the left child on a hit and the skip index on a miss or after a leaf.
+// Knowing the size of every subtree up front lets each node be written straight at its final index.
+size_t BinaryTree::GetSubtreeNodeCount(size_t pointCount)
+{
+   // A split gives (n + 1) / 2 and n / 2 points: a generation only ever holds ranges of two
+   // consecutive sizes, smallSize and smallSize + 1
+   size_t smallSize = pointCount;
+   size_t smallCount = 1;
+   size_t bigCount = 0;
+
+   size_t nodeCount = 0;
+   while (smallCount + bigCount > 0)
+   {
+      nodeCount += smallCount + bigCount;
+
+      // Leaves stop here
+      if (smallSize + 1 <= MAX_POINTS_PER_LEAVES)
+         break;
+      if (smallSize <= MAX_POINTS_PER_LEAVES)
+         smallCount = 0;
+
+      if (smallSize % 2 == 0)
+      {
+         // 2m -> m, m and 2m + 1 -> m + 1, m
+         smallCount = 2 * smallCount + bigCount;
+      }
+      else
+      {
+         // 2m + 1 -> m + 1, m and 2m + 2 -> m + 1, m + 1
+         bigCount = smallCount + 2 * bigCount;
+      }
+      smallSize /= 2;
+   }
+
+   return nodeCount;
 }
 
 glm::vec3 *BinaryTree::FillGPUPointsArray(std::vector<glm::vec3> &pointCloudPoints)
@@ -222,351 +781,1378 @@ glm::vec3 *BinaryTree::FillGPUPointsArray(std::vector<glm::vec3> &pointCloudPoin
 //    return toReturn;
 // }
 
-std::vector<glm::vec3> BinaryTree::GetPointsInBoxRecursive(Node *node, std::vector<glm::vec3> points)
+void BinaryTree::GetSubtreePointRange(int nodeIndex, size_t &first, size_t &last) const
 {
-   points.insert(points.end(), node->cloudPoints.begin(), node->cloudPoints.end());
+   // Subtrees own contiguous point ranges: from their leftmost leaf to their last node in depth-first order
+   int firstLeaf = nodeIndex;
+   while (m_nodes[firstLeaf].pointCount == 0)
+      firstLeaf = m_nodes[firstLeaf].left;
 
-   if (node->left != nullptr)
-   {
-      points = GetPointsInBoxRecursive(node->left, points);
-   }
-   if (node->right != nullptr)
+   const Node &lastLeaf = m_nodes[m_nodes[nodeIndex].skipIndex - 1];
+
+   first = m_nodes[firstLeaf].pointOffset;
+   last = lastLeaf.pointOffset + lastLeaf.pointCount;
+}
+
+int BinaryTree::Nearest(glm::vec3 point, float *distanceSqr) const
+{
+   float nearestDistanceSqr = std::numeric_limits<float>::max();
+   const int index = NearestFrom(point, -1, nearestDistanceSqr);
+
+   if (distanceSqr != nullptr)
+      *distanceSqr = nearestDistanceSqr;
+
+   return index;
+}
+
+void BinaryTree::NearestBatch(const glm::vec3 *points, size_t count, int *outIndices, float *outDistancesSqr,
+                              WorkStealingPool *pool) const
+{
+   auto runRange = [&](size_t rangeBegin, size_t rangeEnd)
    {
-      points = GetPointsInBoxRecursive(node->right, points);
-   }
+      // Neighbouring queries (particles, grid samples) tend to share their nearest point:
+      // the previous answer bounds the search from the start
+      int guess = -1;
+      for (size_t i = rangeBegin; i < rangeEnd; i++)
+      {
+         float distanceSqr = std::numeric_limits<float>::max();
+         guess = NearestFrom(points[i], guess, distanceSqr);
+
+         outIndices[i] = guess;
+         if (outDistancesSqr != nullptr)
+            outDistancesSqr[i] = distanceSqr;
+      }
+   };
 
-   return points;
+   if (pool == nullptr)
+      runRange(0, count);
+   else
+      pool->ParallelFor(0, count, NEAREST_BATCH_GRAIN, runRange);
 }
 
-glm::vec3 BinaryTree::GetNearestPoint(glm::vec3 point, float radius, int deepness, Node *node)
+int BinaryTree::NearestFrom(glm::vec3 point, int guess, float &distanceSqr) const
 {
-   // Get the smaller possible box where the sphere is in
-   // Node *nearestBox = GetNearestBoxesRecursive(glm::vec3(50, 50, 50), 1, 0, root);
+   if (m_nodes.size() <= ROOT_INDEX)
+      return -1;
 
-   // Get all the points inside the box recursivly to get the minimum amount of points to test
-   std::vector<glm::vec3> cloudPoints;
-   cloudPoints = GetPointsInBoxRecursive(node, cloudPoints);
+   int nearest = -1;
+   float nearestDistanceSqr = std::numeric_limits<float>::max();
+   if (guess >= 0)
+   {
+      const glm::vec3 diff = generatedPoints[guess] - point;
+      nearest = guess;
+      nearestDistanceSqr = dot(diff, diff);
+   }
 
-   if (cloudPoints.size() < 1)
+   struct StackEntry
    {
-      std::cout << "Failed to get point" << std::endl;
-      return glm::vec3(-1, -1, -1);
+      int nodeIndex;
+      float distanceSqr;
+   };
+   std::array<StackEntry, MAX_TREE_DEPTH + 1> stack;
+   int stackSize = 0;
+   stack[stackSize++] = { ROOT_INDEX, DistanceSqrToBox(m_nodes[ROOT_INDEX], point) };
+
+   alignas(32) std::array<float, LEAF_DISTANCE_SLOTS> leafDistancesSqr;
+   while (stackSize > 0)
+   {
+      const StackEntry entry = stack[--stackSize];
+      if (entry.distanceSqr >= nearestDistanceSqr)
+         continue;
+
+      const Node &node = m_nodes[entry.nodeIndex];
+      if (node.pointCount > 0)
+      {
+         LeafDistancesSqr(&m_pointsX[node.pointOffset], &m_pointsY[node.pointOffset], &m_pointsZ[node.pointOffset],
+                          node.pointCount, point, leafDistancesSqr.data());
+         for (int i = 0; i < node.pointCount; i++)
+         {
+            if (leafDistancesSqr[i] < nearestDistanceSqr)
+            {
+               nearestDistanceSqr = leafDistancesSqr[i];
+               nearest = node.pointOffset + i;
+            }
+         }
+         continue;
+      }
+
+      StackEntry nearChild = { node.left, DistanceSqrToBox(m_nodes[node.left], point) };
+      StackEntry farChild = { node.right, DistanceSqrToBox(m_nodes[node.right], point) };
+      if (farChild.distanceSqr < nearChild.distanceSqr)
+         std::swap(nearChild, farChild);
+
+      if (farChild.distanceSqr < nearestDistanceSqr)
+         stack[stackSize++] = farChild;
+      if (nearChild.distanceSqr < nearestDistanceSqr)
+         stack[stackSize++] = nearChild;
    }
 
-   // Return the nearest point inside the array you just made
-   glm::vec3 nearestPoint = cloudPoints[0];
+   distanceSqr = nearestDistanceSqr;
+   return nearest;
+}
 
-   glm::vec3 diff = cloudPoints[0] - point;
-   float distSqr = dot(diff, diff);
-   float minDist = distSqr;
+size_t BinaryTree::KNearest(glm::vec3 point, size_t k, int *outIndices, float *outDistancesSqr) const
+{
+   if (k == 0 || m_nodes.size() <= ROOT_INDEX)
+      return 0;
 
-   for (int i = 1; i < cloudPoints.size(); i++)
+   // Depth-first, nearest child first. Every level leaves at most one sibling behind.
+   struct StackEntry
+   {
+      int nodeIndex;
+      float distanceSqr;
+   };
+   std::array<StackEntry, MAX_TREE_DEPTH + 1> stack;
+   int stackSize = 0;
+   stack[stackSize++] = { ROOT_INDEX, DistanceSqrToBox(m_nodes[ROOT_INDEX], point) };
+
+   alignas(32) std::array<float, LEAF_DISTANCE_SLOTS> leafDistancesSqr;
+   size_t found = 0;
+   while (stackSize > 0)
    {
-      diff = cloudPoints[i] - point;
-      distSqr = dot(diff, diff);
+      const StackEntry entry = stack[--stackSize];
 
-      if (distSqr < minDist)
+      // The list may have filled up since it was pushed
+      if (found == k && entry.distanceSqr >= outDistancesSqr[k - 1])
+         continue;
+
+      const Node &node = m_nodes[entry.nodeIndex];
+      if (node.pointCount > 0)
       {
-         nearestPoint = cloudPoints[i];
-         minDist = distSqr;
+         LeafDistancesSqr(&m_pointsX[node.pointOffset], &m_pointsY[node.pointOffset], &m_pointsZ[node.pointOffset],
+                          node.pointCount, point, leafDistancesSqr.data());
+         for (int i = 0; i < node.pointCount; i++)
+         {
+            const float distSqr = leafDistancesSqr[i];
+            if (found == k && distSqr >= outDistancesSqr[k - 1])
+               continue;
+
+            // Insertion in the sorted list, the farthest one drops out once it is full
+            size_t slot = found < k ? found++ : k - 1;
+            for (; slot > 0 && outDistancesSqr[slot - 1] > distSqr; slot--)
+            {
+               outIndices[slot] = outIndices[slot - 1];
+               outDistancesSqr[slot] = outDistancesSqr[slot - 1];
+            }
+            outIndices[slot] = node.pointOffset + i;
+            outDistancesSqr[slot] = distSqr;
+         }
+         continue;
       }
+
+      StackEntry nearChild = { node.left, DistanceSqrToBox(m_nodes[node.left], point) };
+      StackEntry farChild = { node.right, DistanceSqrToBox(m_nodes[node.right], point) };
+      if (farChild.distanceSqr < nearChild.distanceSqr)
+         std::swap(nearChild, farChild);
+
+      const float bound = found == k ? outDistancesSqr[k - 1] : std::numeric_limits<float>::max();
+      if (farChild.distanceSqr < bound)
+         stack[stackSize++] = farChild;
+      if (nearChild.distanceSqr < bound)
+         stack[stackSize++] = nearChild;
    }
 
-   return nearestPoint;
+   return found;
 }
 
-
-std::vector<glm::vec3> BinaryTree::GetBox(std::vector<glm::vec3> data)
+size_t BinaryTree::RadiusSearch(glm::vec3 point, float radius, std::vector<int> &outIndices) const
 {
-   glm::vec3 min = {data[0].x, data[0].y, data[0].z};
-   glm::vec3 max = {data[0].x, data[0].y, data[0].z};
+   outIndices.clear();
+   if (m_nodes.size() <= ROOT_INDEX || radius < 0)
+      return 0;
 
-   for (int i = 1; i < data.size(); i++)
+   const float radiusSqr = radius * radius;
+
+   std::array<int, MAX_TREE_DEPTH + 1> stack;
+   int stackSize = 0;
+   stack[stackSize++] = ROOT_INDEX;
+
+   alignas(32) std::array<float, LEAF_DISTANCE_SLOTS> leafDistancesSqr;
+
+   while (stackSize > 0)
    {
-      for (int j = 0; j < 3; j++)
+      const int nodeIndex = stack[--stackSize];
+      const Node &node = m_nodes[nodeIndex];
+
+      if (!CheckBoxSphereIntersection(node, point, radius))
+         continue;
+
+      // The whole box is in the sphere: take its points without testing them (needs the contiguous ranges)
+      if (m_depthFirst && FarthestDistanceSqrInBox(node, point) <= radiusSqr)
+      {
+         size_t first = 0;
+         size_t last = 0;
+         GetSubtreePointRange(nodeIndex, first, last);
+         for (size_t i = first; i < last; i++)
+            outIndices.push_back(static_cast<int>(i));
+         continue;
+      }
+
+      if (node.pointCount > 0)
       {
-         if (data[i][j] < min[j])
-            min[j] = data[i][j];
-         if (data[i][j] > max[j])
-            max[j] = data[i][j];
+         LeafDistancesSqr(&m_pointsX[node.pointOffset], &m_pointsY[node.pointOffset], &m_pointsZ[node.pointOffset],
+                          node.pointCount, point, leafDistancesSqr.data());
+         for (int i = 0; i < node.pointCount; i++)
+         {
+            if (leafDistancesSqr[i] <= radiusSqr)
+               outIndices.push_back(node.pointOffset + i);
+         }
+         continue;
       }
+
+      stack[stackSize++] = node.right;
+      stack[stackSize++] = node.left;
    }
 
-   std::vector<glm::vec3> box;
-   box.push_back(min);
+   return outIndices.size();
+}
+
 
-   max[0] -= min[0];
-   max[1] -= min[1];
-   max[2] -= min[2];
+std::array<glm::vec3, 2> BinaryTree::GetBox(size_t first, size_t last) const
+{
+   glm::vec3 min = generatedPoints[first];
+   glm::vec3 max = generatedPoints[first];
 
-   box.push_back(max);
+   for (size_t i = first + 1; i < last; i++)
+   {
+      min = glm::min(min, generatedPoints[i]);
+      max = glm::max(max, generatedPoints[i]);
+   }
 
-   return box;
+   return { min, max - min };
 }
 
-void BinaryTree::FillUpTreeRecursive(const std::vector<glm::vec3> &data, Node *root, int deepness = 0)
+void BinaryTree::FillUpTreeRecursive(size_t first, size_t last, int nodeIndex, int deepness, TaskGroup *group, bool inScratch)
 {
-   if (root == nullptr)
+   if (last <= first)
       return;
-   if (data.size() < 1)
-      return;
-   if (data.size() <= MAX_POINTS_PER_LEAVES)
+
+   Node &node = m_nodes[nodeIndex];
+   node.skipIndex = nodeIndex + static_cast<int>(GetSubtreeNodeCount(last - first));
+
+   if (last - first <= MAX_POINTS_PER_LEAVES)
    {
+      if (inScratch)
+         std::copy(m_scratchPoints.begin() + first, m_scratchPoints.begin() + last, generatedPoints.begin() + first);
+
       // Set box
-      std::vector<glm::vec3> rootbox = GetBox(data);
-      root->boxPos = rootbox[0];
-      root->boxSize = rootbox[1];
+      std::array<glm::vec3, 2> rootbox = GetBox(first, last);
+      node.boxPos = rootbox[0];
+      node.boxSize = rootbox[1];
 
-      // Add points
-      for (int i = 0; i < data.size(); i++)
-      {
-         root->cloudPoints[i] = data[i];
-      }
+      // Points stay where the build left them
+      node.pointOffset = static_cast<int>(first);
+      node.pointCount = static_cast<int>(last - first);
 
       // No children, it is a leaf
-      root->right = nullptr;
-      root->left = nullptr;
+      node.left = 0;
+      node.right = 0;
       return;
    }
 
+   int axis = deepness % 3;
+
+   size_t mid = first;
+   node.slice = FindOptimalSlice(first, last, deepness, node.boxPos[axis], node.boxPos[axis] + node.boxSize[axis], mid, inScratch);
+
+   // Left subtree right after this node, right subtree right after the left one
+   node.left = nodeIndex + 1;
+   node.right = node.left + static_cast<int>(GetSubtreeNodeCount(mid - first));
+
+   float boxMax = node.boxPos[axis] + node.boxSize[axis];
+
+   // Fill up boxes
+   Node &left = m_nodes[node.left];
+   left.boxPos = node.boxPos;
+   left.boxSize = node.boxSize;
+   left.boxSize[axis] = node.slice - node.boxPos[axis];
+   left.mortonNumber = node.mortonNumber << 1;
+
+   Node &right = m_nodes[node.right];
+   right.boxPos = node.boxPos;
+   right.boxPos[axis] = node.slice;
+   right.boxSize = node.boxSize;
+   right.boxSize[axis] = boxMax - node.slice;
+   right.mortonNumber = (node.mortonNumber << 1) + 1;
+
+   // Both halves are independent: fork the left one and keep going with the right one
+   const int leftIndex = node.left;
+   const int rightIndex = node.right;
+   if (group != nullptr && last - first > m_buildSettings.sequentialCutoff)
+   {
+      group->Run([this, first, mid, leftIndex, deepness, group, inScratch]()
+      {
+         FillUpTreeRecursive(first, mid, leftIndex, deepness + 1, group, inScratch);
+      });
+   }
+   else
+   {
+      FillUpTreeRecursive(first, mid, leftIndex, deepness + 1, group, inScratch);
+   }
+
+   FillUpTreeRecursive(mid, last, rightIndex, deepness + 1, group, inScratch);
+}
+
+float BinaryTree::FindOptimalSlice(size_t first, size_t last, int deepness, float axisMin, float axisMax, size_t &mid, bool &inScratch)
+{
+   const int axis = deepness % 3;
+   auto lessOnAxis = [axis](const glm::vec3 &a, const glm::vec3 &b) { return a[axis] < b[axis]; };
+
+   // Left gets the lower half (rounded up), split by count so duplicates cannot unbalance the tree
+   mid = first + (last - first + 1) / 2;
+
+   std::vector<glm::vec3>::iterator begin = generatedPoints.begin();
+
+   if (m_buildSettings.medianBinCount > 1 && last - first > m_buildSettings.binnedSplitCutoff &&
+       (m_pool == nullptr || last - first <= m_buildSettings.parallelSplitCutoff))
+   {
+      const float leftMax = BinnedSelect(first, last, mid, axis, axisMin, axisMax, inScratch);
+      return (leftMax + (inScratch ? m_scratchPoints : generatedPoints)[mid][axis]) / 2;
+   }
+
+   // The exact selections work in generatedPoints
+   if (inScratch)
+   {
+      std::copy(m_scratchPoints.begin() + first, m_scratchPoints.begin() + last, begin + first);
+      inScratch = false;
+   }
+
+   float leftMax;
+   if (m_pool != nullptr && last - first > m_buildSettings.parallelSplitCutoff)
+   {
+      ParallelSelect(first, last, mid, axis);
+      leftMax = ParallelMaxOnAxis(first, mid, axis);
+   }
+   else
+   {
+      // Linear time selection: everything before mid is <= generatedPoints[mid] <= everything after
+      std::nth_element(begin + first, begin + mid, begin + last, lessOnAxis);
+      leftMax = (*std::max_element(begin + first, begin + mid, lessOnAxis))[axis];
+   }
+
+   float rightMin = generatedPoints[mid][axis];
+
+   // Return median
+   return (leftMax + rightMin) / 2;
+}
+
+float BinaryTree::BinnedSelect(size_t first, size_t last, size_t nth, int axis, float axisMin, float axisMax, bool &inScratch)
+{
+   const int binCount = std::min(m_buildSettings.medianBinCount, MAX_MEDIAN_BINS);
+   const float scale = axisMax > axisMin ? static_cast<float>(binCount) / (axisMax - axisMin) : 0.f;
+
+   // Never decreases with the value, so a lower bin only holds lower values
+   const auto getBin = [axis, axisMin, scale, binCount](const glm::vec3 &point)
+   {
+      return std::clamp(static_cast<int>((point[axis] - axisMin) * scale), 0, binCount - 1);
+   };
+
+   const std::vector<glm::vec3> &source = inScratch ? m_scratchPoints : generatedPoints;
+   std::vector<glm::vec3> &destination = inScratch ? generatedPoints : m_scratchPoints;
+   inScratch = !inScratch;
+
+   std::array<size_t, MAX_MEDIAN_BINS> binSizes;
+   std::fill_n(binSizes.begin(), binCount, 0);
+   for (size_t i = first; i < last; i++)
+      binSizes[getBin(source[i])]++;
+
+   // Bin holding nth
+   int nthBin = 0;
+   size_t binFirst = first;
+   while (binFirst + binSizes[nthBin] <= nth)
+      binFirst += binSizes[nthBin++];
+   const size_t binLast = binFirst + binSizes[nthBin];
+
+   // Lower bins, the nth bin, higher bins: scattered without a branch, no copy back
+   std::array<size_t, 3> cursors = { first, binFirst, binLast };
+   for (size_t i = first; i < last; i++)
+   {
+      const int bin = getBin(source[i]);
+      destination[cursors[(bin >= nthBin) + (bin > nthBin)]++] = source[i];
+   }
+
+   const auto lessOnAxis = [axis](const glm::vec3 &a, const glm::vec3 &b) { return a[axis] < b[axis]; };
+   std::vector<glm::vec3>::iterator begin = destination.begin();
+   std::nth_element(begin + binFirst, begin + nth, begin + binLast, lessOnAxis);
+
+   // The highest value before nth is in the nth bin, or else in the lower bins
+   if (nth > binFirst)
+      return (*std::max_element(begin + binFirst, begin + nth, lessOnAxis))[axis];
+   return (*std::max_element(begin + first, begin + binFirst, lessOnAxis))[axis];
+}
+
+void BinaryTree::ParallelSelect(size_t first, size_t last, size_t nth, int axis)
+{
+   constexpr size_t SAMPLE_COUNT = 63;
+
+   const size_t chunkCount = m_pool->GetThreadCount() * 4;
 
-   std::vector<std::vector<glm::vec3> > result = FillUpTree(data, root, deepness);
-   const std::vector<glm::vec3> leftNodes = result[0];
-   const std::vector<glm::vec3> rightNodes = result[1];
+   size_t low = first;
+   size_t high = last;
 
-   if (root->left != nullptr)
+   while (high - low > m_buildSettings.parallelSplitCutoff)
    {
-      // Fill up box
-      root->left->boxPos = root->boxPos;
-      root->left->boxSize = root->boxSize;
-      root->left->boxSize[deepness % 3] = root->slice - root->boxPos[deepness % 3];
-      FillUpTreeRecursive(leftNodes, root->left, deepness + 1);
+      // Pivot: median of evenly spaced samples
+      std::array<float, SAMPLE_COUNT> samples;
+      const size_t stride = (high - low) / SAMPLE_COUNT;
+      for (size_t i = 0; i < SAMPLE_COUNT; i++)
+         samples[i] = generatedPoints[low + i * stride][axis];
+
+      std::nth_element(samples.begin(), samples.begin() + SAMPLE_COUNT / 2, samples.end());
+      const float pivot = samples[SAMPLE_COUNT / 2];
+
+      const size_t chunkSize = (high - low + chunkCount - 1) / chunkCount;
+
+      // Count lower / equal / greater per chunk
+      std::vector<std::array<size_t, 3>> offsets(chunkCount, { 0, 0, 0 });
+      m_pool->ParallelFor(0, chunkCount, 1, [&](size_t chunkBegin, size_t chunkEnd)
+      {
+         for (size_t chunk = chunkBegin; chunk < chunkEnd; chunk++)
+         {
+            const size_t end = std::min(high, low + (chunk + 1) * chunkSize);
+            for (size_t i = low + chunk * chunkSize; i < end; i++)
+            {
+               const float value = generatedPoints[i][axis];
+               offsets[chunk][value < pivot ? 0 : (value == pivot ? 1 : 2)]++;
+            }
+         }
+      });
+
+      // Exclusive prefix sums -> where each chunk writes each of its three groups
+      size_t lowerCount = 0;
+      size_t equalCount = 0;
+      for (const std::array<size_t, 3> &count : offsets)
+      {
+         lowerCount += count[0];
+         equalCount += count[1];
+      }
+
+      size_t lowerOffset = low;
+      size_t equalOffset = low + lowerCount;
+      size_t greaterOffset = low + lowerCount + equalCount;
+      for (std::array<size_t, 3> &offset : offsets)
+      {
+         const std::array<size_t, 3> count = offset;
+         offset = { lowerOffset, equalOffset, greaterOffset };
+         lowerOffset += count[0];
+         equalOffset += count[1];
+         greaterOffset += count[2];
+      }
+
+      // Scatter into the scratch, then copy back
+      m_pool->ParallelFor(0, chunkCount, 1, [&](size_t chunkBegin, size_t chunkEnd)
+      {
+         for (size_t chunk = chunkBegin; chunk < chunkEnd; chunk++)
+         {
+            const size_t end = std::min(high, low + (chunk + 1) * chunkSize);
+            for (size_t i = low + chunk * chunkSize; i < end; i++)
+            {
+               const float value = generatedPoints[i][axis];
+               m_scratchPoints[offsets[chunk][value < pivot ? 0 : (value == pivot ? 1 : 2)]++] = generatedPoints[i];
+            }
+         }
+      });
+
+      m_pool->ParallelFor(low, high, m_buildSettings.sequentialCutoff, [&](size_t rangeBegin, size_t rangeEnd)
+      {
+         std::copy(m_scratchPoints.begin() + rangeBegin, m_scratchPoints.begin() + rangeEnd, generatedPoints.begin() + rangeBegin);
+      });
+
+      if (nth < low + lowerCount)
+         high = low + lowerCount;
+      else if (nth < low + lowerCount + equalCount)
+         return; // nth landed in the pivot run, already in place
+      else
+         low = low + lowerCount + equalCount;
    }
-   if (root->right != nullptr)
+
+   std::vector<glm::vec3>::iterator begin = generatedPoints.begin();
+   std::nth_element(begin + low, begin + nth, begin + high,
+                    [axis](const glm::vec3 &a, const glm::vec3 &b) { return a[axis] < b[axis]; });
+}
+
+float BinaryTree::ParallelMaxOnAxis(size_t first, size_t last, int axis)
+{
+   std::mutex mutex;
+   float maxValue = generatedPoints[first][axis];
+
+   m_pool->ParallelFor(first, last, m_buildSettings.sequentialCutoff, [&](size_t rangeBegin, size_t rangeEnd)
+   {
+      float rangeMax = generatedPoints[rangeBegin][axis];
+      for (size_t i = rangeBegin + 1; i < rangeEnd; i++)
+         rangeMax = std::max(rangeMax, generatedPoints[i][axis]);
+
+      std::lock_guard<std::mutex> lock(mutex);
+      maxValue = std::max(maxValue, rangeMax);
+   });
+
+   return maxValue;
+}
+
+void BinaryTree::PrintNode(const Node &node)
+{
+   std::bitset<16> bits(node.mortonNumber);
+
+   std::cout << "Node" << std::endl << "Slice : " << node.slice << std::endl << "Box : (" << node.boxPos[0] << ", " <<
+         node.boxPos[1] << ", " << node.boxPos[2] << ")," "(" << node.boxSize[0] << ", " << node.boxSize[1] << ", "
+         << node.boxSize[2] << "), " << std::endl << "Children : " << (node.left != 0 ? "TRUE" : "FALSE") <<
+         ", " << (node.right != 0 ? "TRUE" : "FALSE") << std::endl << "Morton : " << node.mortonNumber <<
+         ", Morton(bits) : " << bits << std::endl
+
+         // << "Number of cloud points : " << node.cloudPoints.size()
+
+         // << "cloud points : " << node.cloudPoints[0] << ", " << node.cloudPoints[1] << ", " << node.cloudPoints[2]
+         // << ", " << node.cloudPoints[3]
+
+         << std::endl << std::endl;
+}
+
+void BinaryTree::PrintNodeRecursive(int nodeIndex)
+{
+   const Node &node = m_nodes[nodeIndex];
+   PrintNode(node);
+
+   if (node.left != 0)
+      PrintNodeRecursive(node.left);
+   if (node.right != 0)
+      PrintNodeRecursive(node.right);
+}
+
+bool BinaryTree::CheckBoxSphereIntersection(const Node &node, glm::vec3 point, float radius)
+{
+   return DistanceSqrToBox(node, point) <= radius * radius;
+}
+
+void BinaryTree::Insert(const glm::vec3 *points, size_t count)
+{
+   if (count == 0)
+      return;
+
+   PrepareUpdates();
+   for (size_t i = 0; i < count; i++)
+      InsertPoint(points[i]);
+
+   if (m_freePointSlots > m_pointCount)
+      Compact();
+
+   m_builtCost = GetTreeCost();
+}
+
+size_t BinaryTree::Remove(const glm::vec3 *points, size_t count)
+{
+   if (count == 0 || m_pointCount == 0)
+      return 0;
+
+   PrepareUpdates();
+   size_t removed = 0;
+   for (size_t i = 0; i < count; i++)
    {
-      root->right->boxPos = root->boxPos;
-      root->right->boxPos[deepness % 3] = root->slice;
-      root->right->boxSize = root->boxSize;
-      root->right->boxSize[deepness % 3] = root->slice - root->boxPos[deepness % 3];
-      FillUpTreeRecursive(rightNodes, root->right, deepness + 1);
+      if (RemovePoint(points[i]))
+         removed++;
    }
+
+   if (m_freePointSlots > m_pointCount)
+      Compact();
+
+   m_builtCost = GetTreeCost();
+   return removed;
 }
 
-std::vector<std::vector<glm::vec3> > BinaryTree::FillUpTree(const std::vector<glm::vec3> &data, Node *node,
-                                                            int deepness = 0)
+void BinaryTree::PrepareUpdates()
 {
-   std::vector<std::vector<glm::vec3> > results;
+   if (!m_depthFirst)
+      return;
+
+   m_depthFirst = false;
+   m_changedNodes.clear();
+   m_changedPoints.clear();
 
-   node->slice = FindOptimalSlice(data, deepness);
+   // The arena grows from now on, a skip past the last node has to keep meaning "end of traversal"
+   for (Node &node : m_nodes)
+   {
+      if (node.skipIndex >= static_cast<int>(m_nodes.size()))
+         node.skipIndex = 0;
+   }
 
-   std::vector<glm::vec3> leftNodes;
-   std::vector<glm::vec3> rightNodes;
+   m_parents.assign(m_nodes.size(), 0);
+   m_subtreePoints.assign(m_nodes.size(), 0);
+   m_pointLeaves.assign(generatedPoints.size(), 0);
+   m_freeNodes.clear();
+   m_freePointSlots = 0;
 
-   for (int i = 0; i < data.size(); i++)
+   // Children come after their parent in the depth-first layout: backwards, every child is done before its parent
+   for (int i = static_cast<int>(m_nodes.size()) - 1; i >= ROOT_INDEX; i--)
    {
-      if (data[i][deepness % 3] <= node->slice)
+      const Node &node = m_nodes[i];
+      if (node.pointCount > 0)
       {
-         leftNodes.push_back(data[i]);
+         m_subtreePoints[i] = node.pointCount;
+         for (int p = node.pointOffset; p < node.pointOffset + node.pointCount; p++)
+            m_pointLeaves[p] = i;
       }
       else
       {
-         rightNodes.push_back(data[i]);
+         m_parents[node.left] = i;
+         m_parents[node.right] = i;
+         m_subtreePoints[i] = m_subtreePoints[node.left] + m_subtreePoints[node.right];
       }
    }
 
-   results.push_back(leftNodes);
-   results.push_back(rightNodes);
+   // Forwards, every parent is done before its children
+   std::vector<int> depths(m_nodes.size(), 0);
+   m_builtDepth = 0;
+   for (size_t i = ROOT_INDEX + 1; i < m_nodes.size(); i++)
+   {
+      depths[i] = depths[m_parents[i]] + 1;
+      m_builtDepth = std::max(m_builtDepth, depths[i]);
+   }
+}
 
-   return results;
+int BinaryTree::GetDepthLimit() const
+{
+   return std::min(MAX_TREE_DEPTH, std::max(m_builtDepth, 2 * GetGeneration(std::max<size_t>(m_pointCount, 1)) + 2));
 }
 
-float BinaryTree::FindOptimalSlice(std::vector<glm::vec3> data, int deepness = 0)
+void BinaryTree::InsertPoint(glm::vec3 point)
 {
-   std::vector<float> vec;
-   for (int i = 0; i < data.size(); i++)
+   m_pointCount++;
+
+   // Empty tree: the root is a leaf with room for a full one
+   if (m_nodes.size() <= ROOT_INDEX)
    {
-      vec.push_back(data[i][deepness % 3]);
+      m_nodes.assign(ROOT_INDEX + 1, Node());
+      GPUReadyBuffer.resize(ROOT_INDEX + 1);
+      m_parents.assign(ROOT_INDEX + 1, 0);
+      m_subtreePoints.assign(ROOT_INDEX + 1, 0);
+      m_builtDepth = 0;
+
+      Node &root = m_nodes[ROOT_INDEX];
+      root.boxPos = point;
+      root.boxSize = glm::vec3(0);
+      root.pointOffset = static_cast<int>(AllocatePointSlots(MAX_POINTS_PER_LEAVES));
+      root.pointCount = 1;
+      SetPoint(root.pointOffset, point, ROOT_INDEX);
+      m_subtreePoints[ROOT_INDEX] = 1;
+
+      WriteGPUNode(0);
+      WriteGPUNode(ROOT_INDEX);
+      return;
    }
 
-   int n = vec.size();
+   // Down to a leaf, every box on the way grows to take the point in
+   int nodeIndex = ROOT_INDEX;
+   int depth = 0;
+   while (true)
+   {
+      Node &node = m_nodes[nodeIndex];
+      m_subtreePoints[nodeIndex]++;
+
+      const glm::vec3 boxMax = node.boxPos + node.boxSize;
+      const glm::vec3 grownMin = glm::min(node.boxPos, point);
+      const glm::vec3 grownMax = glm::max(boxMax, point);
+      if (grownMin != node.boxPos || grownMax != boxMax)
+      {
+         node.boxPos = grownMin;
+         node.boxSize = grownMax - grownMin;
+         WriteGPUNode(nodeIndex);
+      }
 
-   // Calling quicksort for the vector vec
-   QuickSort(vec, 0, n - 1);
+      if (node.pointCount > 0)
+         break;
 
-   // Return median
-   return (vec[(vec.size() - 1) / 2] + vec[(vec.size() - 1) / 2 + 1]) / 2;
+      // The child that grows the least, the one with fewer points between equal growths
+      const float leftGrowth = AreaGrowth(m_nodes[node.left], point);
+      const float rightGrowth = AreaGrowth(m_nodes[node.right], point);
+      if (leftGrowth < rightGrowth || (leftGrowth == rightGrowth && m_subtreePoints[node.left] <= m_subtreePoints[node.right]))
+         nodeIndex = node.left;
+      else
+         nodeIndex = node.right;
+      depth++;
+   }
+
+   const int pointCount = m_nodes[nodeIndex].pointCount;
+   if (pointCount >= MAX_POINTS_PER_LEAVES)
+   {
+      // Splitting would go past the depth limit: the unbalanced part above is rebuilt with the point instead
+      if (depth + 1 > GetDepthLimit())
+         RebuildSubtree(FindScapegoat(nodeIndex), &point);
+      else
+         SplitLeaf(nodeIndex, point);
+      return;
+   }
+
+   // Room in the leaf: the slot right after or right before its range if unused, otherwise the leaf moves
+   const size_t end = m_nodes[nodeIndex].pointOffset + pointCount;
+   size_t slot = 0;
+   if (end < m_pointLeaves.size() && m_pointLeaves[end] == 0)
+   {
+      slot = end;
+   }
+   else if (m_nodes[nodeIndex].pointOffset > 0 && m_pointLeaves[m_nodes[nodeIndex].pointOffset - 1] == 0)
+   {
+      slot = --m_nodes[nodeIndex].pointOffset;
+   }
+   else
+   {
+      RelocateLeaf(nodeIndex);
+      slot = m_nodes[nodeIndex].pointOffset + pointCount;
+   }
+
+   SetPoint(slot, point, nodeIndex);
+   m_nodes[nodeIndex].pointCount++;
+   WriteGPUNode(nodeIndex);
+}
+
+bool BinaryTree::RemovePoint(glm::vec3 point)
+{
+   float distanceSqr = 0;
+   const int slot = Nearest(point, &distanceSqr);
+   if (slot < 0 || distanceSqr > 0)
+      return false;
+
+   m_pointCount--;
+   const int leafIndex = m_pointLeaves[slot];
+
+   // The last point of the leaf fills the hole
+   const size_t lastSlot = m_nodes[leafIndex].pointOffset + m_nodes[leafIndex].pointCount - 1;
+   if (static_cast<size_t>(slot) != lastSlot)
+      SetPoint(slot, generatedPoints[lastSlot], leafIndex);
+   FreePointSlot(lastSlot);
+   m_nodes[leafIndex].pointCount--;
+
+   for (int ancestor = leafIndex; ancestor != 0; ancestor = m_parents[ancestor])
+      m_subtreePoints[ancestor]--;
+
+   // Last point gone: back to an empty tree
+   if (m_pointCount == 0)
+   {
+      m_nodes.clear();
+      generatedPoints.clear();
+      FillGPUArrays();
+      m_parents.clear();
+      m_subtreePoints.clear();
+      m_pointLeaves.clear();
+      m_freeNodes.clear();
+      m_freePointSlots = 0;
+      m_allChanged = true;
+      return true;
+   }
+
+   const int parentIndex = m_parents[leafIndex];
+   if (parentIndex == 0)
+   {
+      RefitUpwards(leafIndex);
+      return true;
+   }
+
+   const Node &parent = m_nodes[parentIndex];
+   const int siblingIndex = parent.left == leafIndex ? parent.right : parent.left;
+   const Node &sibling = m_nodes[siblingIndex];
+
+   if (sibling.pointCount > 0 && m_nodes[leafIndex].pointCount + sibling.pointCount <= MAX_POINTS_PER_LEAVES / 2)
+   {
+      MergeLeaves(parentIndex);
+      RefitUpwards(parentIndex);
+   }
+   else if (m_nodes[leafIndex].pointCount == 0)
+   {
+      CollapseIntoParent(parentIndex, siblingIndex);
+      RefitUpwards(parentIndex);
+   }
+   else
+   {
+      RefitUpwards(leafIndex);
+   }
+
+   return true;
 }
 
-void BinaryTree::PrintNode(const Node *node)
+int BinaryTree::AllocateNode()
 {
-   std::bitset<16> bits(node->mortonNumber);
+   if (!m_freeNodes.empty())
+   {
+      const int nodeIndex = m_freeNodes.back();
+      m_freeNodes.pop_back();
+      return nodeIndex;
+   }
 
-   std::cout << "Node" << std::endl << "Slice : " << node->slice << std::endl << "Box : (" << node->boxPos[0] << ", " <<
-         node->boxPos[1] << ", " << node->boxPos[2] << ")," "(" << node->boxSize[0] << ", " << node->boxSize[1] << ", "
-         << node->boxSize[2] << "), " << std::endl << "Children : " << (node->left != nullptr ? "TRUE" : "FALSE") <<
-         ", " << (node->right != nullptr ? "TRUE" : "FALSE") << std::endl << "Morton : " << node->mortonNumber <<
-         ", Morton(bits) : " << bits << std::endl
+   m_nodes.emplace_back();
+   GPUReadyBuffer.emplace_back();
+   m_parents.push_back(0);
+   m_subtreePoints.push_back(0);
+   return static_cast<int>(m_nodes.size()) - 1;
+}
 
-         // << "Number of cloud points : " << node->cloudPoints.size()
+void BinaryTree::FreeNode(int nodeIndex)
+{
+   // Nothing links to it anymore, but the passes going over every node id (tile binning, refit) would still
+   // take a stale leaf: the GPU copy is rewritten as an empty node, no points and an inverted box
+   m_nodes[nodeIndex] = Node();
+   m_parents[nodeIndex] = 0;
+   m_subtreePoints[nodeIndex] = 0;
+   m_freeNodes.push_back(nodeIndex);
+   WriteGPUNode(nodeIndex);
+}
 
-         // << "cloud points : " << node->cloudPoints[0] << ", " << node->cloudPoints[1] << ", " << node->cloudPoints[2]
-         // << ", " << node->cloudPoints[3]
+size_t BinaryTree::AllocatePointSlots(size_t count)
+{
+   const size_t first = generatedPoints.size();
+   generatedPoints.resize(first + count, glm::vec3(0));
+   GPUReadyPoints.resize(first + count, glm::vec4(0));
+   m_pointLeaves.resize(first + count, 0);
 
-         << std::endl << std::endl;
+   // Unused slots hold the padding value, the kernels never find them closer than a real point
+   for (std::vector<float> *axisPoints : { &m_pointsX, &m_pointsY, &m_pointsZ })
+      axisPoints->resize(first + count + SOA_PADDING, std::numeric_limits<float>::max());
+
+   m_freePointSlots += count;
+   return first;
 }
 
-void BinaryTree::PrintNodeRecursive(Node *node)
+void BinaryTree::SetPoint(size_t slot, glm::vec3 point, int leafIndex)
 {
-   PrintNode(node);
+   if (m_pointLeaves[slot] == 0)
+      m_freePointSlots--;
+   m_pointLeaves[slot] = leafIndex;
+
+   generatedPoints[slot] = point;
+   GPUReadyPoints[slot] = glm::vec4(point, 1);
+   m_pointsX[slot] = point.x;
+   m_pointsY[slot] = point.y;
+   m_pointsZ[slot] = point.z;
+
+   m_changedPoints.push_back(slot);
+}
+
+void BinaryTree::FreePointSlot(size_t slot)
+{
+   if (m_pointLeaves[slot] == 0)
+      return;
 
-   if (node->left != nullptr)
-      PrintNodeRecursive(node->left);
-   if (node->right != nullptr)
-      PrintNodeRecursive(node->right);
+   m_pointLeaves[slot] = 0;
+   m_freePointSlots++;
 }
 
-void BinaryTree::CreateStructureNodes(int CurrGen, int maxGen, Node *node, int currentMortenNumber)
+void BinaryTree::RelocateLeaf(int leafIndex)
 {
-   CurrGen++;
+   const size_t first = AllocatePointSlots(MAX_POINTS_PER_LEAVES);
+   const Node &leaf = m_nodes[leafIndex];
 
-   currentMortenNumber = currentMortenNumber << 1;
+   for (int i = 0; i < leaf.pointCount; i++)
+   {
+      const size_t oldSlot = leaf.pointOffset + i;
+      FreePointSlot(oldSlot);
+      SetPoint(first + i, generatedPoints[oldSlot], leafIndex);
+   }
 
-   node->left = new Node({0, glm::vec3(0, 0, 0), glm::vec3(0, 0, 0), nullptr, nullptr, currentMortenNumber});
-   node->right = new Node({0, glm::vec3(0, 0, 0), glm::vec3(0, 0, 0), nullptr, nullptr, currentMortenNumber + 1});
+   m_nodes[leafIndex].pointOffset = static_cast<int>(first);
+}
 
-   if (CurrGen != maxGen)
+void BinaryTree::SplitLeaf(int leafIndex, glm::vec3 point)
+{
+   std::array<glm::vec3, MAX_POINTS_PER_LEAVES + 1> points;
+   const int oldCount = m_nodes[leafIndex].pointCount;
+   const size_t oldOffset = m_nodes[leafIndex].pointOffset;
+   const int count = oldCount + 1;
+
+   for (int i = 0; i < oldCount; i++)
+      points[i] = generatedPoints[oldOffset + i];
+   points[oldCount] = point;
+
+   // Median on the longest axis, like SplitByCount
+   glm::vec3 boxMin = points[0];
+   glm::vec3 boxMax = points[0];
+   for (int i = 1; i < count; i++)
    {
-      CreateStructureNodes(CurrGen, maxGen, node->left, currentMortenNumber);
-      CreateStructureNodes(CurrGen, maxGen, node->right, currentMortenNumber + 1);
+      boxMin = glm::min(boxMin, points[i]);
+      boxMax = glm::max(boxMax, points[i]);
    }
+   const glm::vec3 size = boxMax - boxMin;
+   int axis = 0;
+   if (size.y > size[axis])
+      axis = 1;
+   if (size.z > size[axis])
+      axis = 2;
+
+   const int mid = (count + 1) / 2;
+   std::nth_element(points.begin(), points.begin() + mid, points.begin() + count,
+                    [axis](const glm::vec3 &a, const glm::vec3 &b) { return a[axis] < b[axis]; });
+
+   // Both allocations can move the arena, no reference is kept across them
+   const int left = AllocateNode();
+   const int right = AllocateNode();
+   const size_t rightOffset = AllocatePointSlots(MAX_POINTS_PER_LEAVES);
+
+   // The left half keeps the slots of the leaf, the right half takes new ones
+   for (int i = 0; i < oldCount; i++)
+      FreePointSlot(oldOffset + i);
+   for (int i = 0; i < mid; i++)
+      SetPoint(oldOffset + i, points[i], left);
+   for (int i = mid; i < count; i++)
+      SetPoint(rightOffset + i - mid, points[i], right);
+
+   const auto makeLeaf = [this, &points](int nodeIndex, int first, int last, size_t offset, int skipIndex)
+   {
+      Node &node = m_nodes[nodeIndex];
+      glm::vec3 leafMin = points[first];
+      glm::vec3 leafMax = points[first];
+      for (int i = first + 1; i < last; i++)
+      {
+         leafMin = glm::min(leafMin, points[i]);
+         leafMax = glm::max(leafMax, points[i]);
+      }
+
+      node.boxPos = leafMin;
+      node.boxSize = leafMax - leafMin;
+      node.pointOffset = static_cast<int>(offset);
+      node.pointCount = last - first;
+      node.skipIndex = skipIndex;
+      m_subtreePoints[nodeIndex] = last - first;
+   };
+   makeLeaf(left, 0, mid, oldOffset, right);
+   makeLeaf(right, mid, count, rightOffset, m_nodes[leafIndex].skipIndex);
+
+   Node &node = m_nodes[leafIndex];
+   node.left = left;
+   node.right = right;
+   node.pointOffset = 0;
+   node.pointCount = 0;
+   m_parents[left] = leafIndex;
+   m_parents[right] = leafIndex;
+
+   WriteGPUNode(leafIndex);
+   WriteGPUNode(left);
+   WriteGPUNode(right);
 }
 
-BinaryTree::~BinaryTree()
+void BinaryTree::MergeLeaves(int parentIndex)
 {
-   //TODO free allocations
+   const int left = m_nodes[parentIndex].left;
+   const int right = m_nodes[parentIndex].right;
+   const size_t first = AllocatePointSlots(MAX_POINTS_PER_LEAVES);
+
+   int count = 0;
+   for (const int leafIndex : { left, right })
+   {
+      const Node &leaf = m_nodes[leafIndex];
+      for (int i = 0; i < leaf.pointCount; i++)
+      {
+         const size_t oldSlot = leaf.pointOffset + i;
+         FreePointSlot(oldSlot);
+         SetPoint(first + count++, generatedPoints[oldSlot], parentIndex);
+      }
+   }
+
+   FreeNode(left);
+   FreeNode(right);
+
+   // The box is fitted by the refit that follows
+   Node &parent = m_nodes[parentIndex];
+   parent.left = 0;
+   parent.right = 0;
+   parent.pointOffset = static_cast<int>(first);
+   parent.pointCount = count;
 }
 
-Node *BinaryTree::GetNearestBoxesRecursive(glm::vec3 point, float radius, int deepness, Node *node)
+void BinaryTree::CollapseIntoParent(int parentIndex, int keptChild)
 {
-   if (node == nullptr)
+   Node &parent = m_nodes[parentIndex];
+   const int removedChild = parent.left == keptChild ? parent.right : parent.left;
+   const Node kept = m_nodes[keptChild];
+
+   parent.slice = kept.slice;
+   parent.boxPos = kept.boxPos;
+   parent.boxSize = kept.boxSize;
+   parent.left = kept.left;
+   parent.right = kept.right;
+   parent.pointOffset = kept.pointOffset;
+   parent.pointCount = kept.pointCount;
+
+   if (kept.pointCount > 0)
    {
-      std::cout << "FAILED : Node is null" << std::endl;
-      return nullptr;
+      for (int p = kept.pointOffset; p < kept.pointOffset + kept.pointCount; p++)
+         m_pointLeaves[p] = parentIndex;
    }
+   else
+   {
+      m_parents[kept.left] = parentIndex;
+      m_parents[kept.right] = parentIndex;
+
+      // The right spine of a kept left child skipped to the removed node, it now ends where the parent did
+      for (int n = kept.right; n != 0; n = m_nodes[n].pointCount > 0 ? 0 : m_nodes[n].right)
+      {
+         if (m_nodes[n].skipIndex == removedChild)
+         {
+            m_nodes[n].skipIndex = parent.skipIndex;
+            WriteGPUNode(n);
+         }
+      }
+   }
+
+   FreeNode(keptChild);
+   FreeNode(removedChild);
+   WriteGPUNode(parentIndex);
+}
+
+void BinaryTree::RefitUpwards(int nodeIndex)
+{
+   // The first node is always written, its count may have changed
+   for (int n = nodeIndex; n != 0; n = m_parents[n])
+   {
+      Node &node = m_nodes[n];
+      glm::vec3 boxMin;
+      glm::vec3 boxMax;
+      if (node.pointCount > 0)
+      {
+         boxMin = generatedPoints[node.pointOffset];
+         boxMax = boxMin;
+         for (int p = node.pointOffset + 1; p < node.pointOffset + node.pointCount; p++)
+         {
+            boxMin = glm::min(boxMin, generatedPoints[p]);
+            boxMax = glm::max(boxMax, generatedPoints[p]);
+         }
+      }
+      else
+      {
+         const Node &left = m_nodes[node.left];
+         const Node &right = m_nodes[node.right];
+         boxMin = glm::min(left.boxPos, right.boxPos);
+         boxMax = glm::max(left.boxPos + left.boxSize, right.boxPos + right.boxSize);
+      }
 
-   // if a leaf, return the leaf point
-   if (node->left == nullptr && node->right == nullptr)
-      return node;
+      if (n != nodeIndex && boxMin == node.boxPos && boxMax - boxMin == node.boxSize)
+         break;
 
-   // if only one child remaining : return it
-   if (node->left == nullptr)
-      return node->right;
-   else if (node->right == nullptr)
-      return node->left;
+      node.boxPos = boxMin;
+      node.boxSize = boxMax - boxMin;
+      WriteGPUNode(n);
+   }
+}
+
+int BinaryTree::FindScapegoat(int nodeIndex) const
+{
+   for (int n = m_parents[nodeIndex]; n != 0; n = m_parents[n])
+   {
+      const Node &node = m_nodes[n];
+      const int biggestChild = std::max(m_subtreePoints[node.left], m_subtreePoints[node.right]);
+      if (static_cast<float>(biggestChild) > MAX_CHILD_SHARE * static_cast<float>(m_subtreePoints[n]))
+         return n;
+   }
 
-   // check box-sphere intersection
-   bool left = CheckBoxSphereIntersection(node->left, point, radius);
-   bool right = CheckBoxSphereIntersection(node->right, point, radius);
+   return ROOT_INDEX;
+}
 
-   // if only one of them is good, GetNearestBoxRecursive in the intersecting box
-   if (left | right)
+void BinaryTree::RebuildSubtree(int nodeIndex, const glm::vec3 *extraPoint)
+{
+   // Points and nodes of the subtree are given back, its root excepted
+   std::vector<glm::vec3> points;
+   points.reserve(m_subtreePoints[nodeIndex]);
+
+   std::array<int, MAX_TREE_DEPTH + 1> stack;
+   int stackSize = 0;
+   stack[stackSize++] = nodeIndex;
+   while (stackSize > 0)
    {
-      if (left)
+      const int n = stack[--stackSize];
+      const Node node = m_nodes[n];
+      if (node.pointCount > 0)
       {
-         return GetNearestBoxesRecursive(point, radius, deepness + 1, node->left);
+         for (int p = node.pointOffset; p < node.pointOffset + node.pointCount; p++)
+         {
+            points.push_back(generatedPoints[p]);
+            FreePointSlot(p);
+         }
       }
       else
       {
-         return GetNearestBoxesRecursive(point, radius, deepness + 1, node->right);
+         stack[stackSize++] = node.right;
+         stack[stackSize++] = node.left;
       }
+
+      if (n != nodeIndex)
+         FreeNode(n);
    }
 
-   // if both of them are colliding, return all the points inside the both boxes (get them with morten indexes i guess?)
-   if (left && right)
+   if (extraPoint != nullptr)
+      points.push_back(*extraPoint);
+
+   const size_t first = AllocatePointSlots(points.size());
+   std::copy(points.begin(), points.end(), generatedPoints.begin() + first);
+
+   EmitRebuiltRecursive(first, first + points.size(), nodeIndex, m_nodes[nodeIndex].skipIndex);
+}
+
+void BinaryTree::EmitRebuiltRecursive(size_t first, size_t last, int nodeIndex, int skipIndex)
+{
+   const std::array<glm::vec3, 2> box = GetBox(first, last);
+   Node &node = m_nodes[nodeIndex];
+   node.boxPos = box[0];
+   node.boxSize = box[1];
+   node.skipIndex = skipIndex;
+   m_subtreePoints[nodeIndex] = static_cast<int>(last - first);
+
+   if (last - first <= MAX_POINTS_PER_LEAVES)
    {
-      return node;
+      node.left = 0;
+      node.right = 0;
+      node.pointOffset = static_cast<int>(first);
+      node.pointCount = static_cast<int>(last - first);
+      for (size_t p = first; p < last; p++)
+         SetPoint(p, generatedPoints[p], nodeIndex);
+
+      WriteGPUNode(nodeIndex);
+      return;
    }
 
-   // if nothing intersect, return null
-   // i think we never go here... depending on the minimal cuts variant...
-   if (!left && !right)
+   std::array<std::array<glm::vec3, 2>, 2> childBoxes;
+   const size_t mid = SplitByCount(first, last, box, childBoxes);
+
+   // Both allocations can move the arena
+   const int left = AllocateNode();
+   const int right = AllocateNode();
+   m_nodes[nodeIndex].left = left;
+   m_nodes[nodeIndex].right = right;
+   m_nodes[nodeIndex].pointOffset = 0;
+   m_nodes[nodeIndex].pointCount = 0;
+   m_parents[left] = nodeIndex;
+   m_parents[right] = nodeIndex;
+   WriteGPUNode(nodeIndex);
+
+   EmitRebuiltRecursive(first, mid, left, right);
+   EmitRebuiltRecursive(mid, last, right, skipIndex);
+}
+
+void BinaryTree::Compact()
+{
+   if (m_depthFirst)
+      return;
+
+   std::vector<Node> nodes;
+   std::vector<glm::vec3> points;
+   if (m_nodes.size() > ROOT_INDEX)
    {
-      return nullptr;
+      nodes.reserve(m_nodes.size() - m_freeNodes.size());
+      nodes.resize(ROOT_INDEX);
+      points.reserve(m_pointCount);
+      CompactRecursive(ROOT_INDEX, nodes, points);
    }
-   return nullptr;
+
+   m_nodes = std::move(nodes);
+   generatedPoints = std::move(points);
+
+   m_depthFirst = true;
+   FillGPUArrays();
+
+   m_parents = std::vector<int>();
+   m_subtreePoints = std::vector<int>();
+   m_pointLeaves = std::vector<int>();
+   m_freeNodes = std::vector<int>();
+   m_freePointSlots = 0;
+   m_changedNodes.clear();
+   m_changedPoints.clear();
+   m_allChanged = true;
 }
 
-bool BinaryTree::CheckBoxSphereIntersection(Node *node, glm::vec3 point, float radius)
+void BinaryTree::CompactRecursive(int nodeIndex, std::vector<Node> &nodes, std::vector<glm::vec3> &points) const
 {
-   // Naive method
-   // TODO improve it
+   const int newIndex = static_cast<int>(nodes.size());
+   const Node &node = m_nodes[nodeIndex];
+   nodes.push_back(node);
 
-   std::vector<glm::vec3> boxPoints;
+   if (node.pointCount > 0)
+   {
+      nodes[newIndex].pointOffset = static_cast<int>(points.size());
+      points.insert(points.end(), generatedPoints.begin() + node.pointOffset,
+                    generatedPoints.begin() + node.pointOffset + node.pointCount);
+   }
+   else
+   {
+      nodes[newIndex].left = static_cast<int>(nodes.size());
+      CompactRecursive(node.left, nodes, points);
+      nodes[newIndex].right = static_cast<int>(nodes.size());
+      CompactRecursive(node.right, nodes, points);
+   }
 
-   boxPoints.push_back(node->boxPos);
-   boxPoints.push_back(node->boxPos + glm::vec3(node->boxSize.x, 0, 0));
-   boxPoints.push_back(node->boxPos + glm::vec3(0, node->boxSize.y, 0));
-   boxPoints.push_back(node->boxPos + glm::vec3(0, 0, node->boxSize.z));
+   // Past the last node for the right spine of the tree, like the builders
+   nodes[newIndex].skipIndex = static_cast<int>(nodes.size());
+}
 
-   boxPoints.push_back(node->boxPos + node->boxSize - glm::vec3(node->boxSize.x, 0, 0));
-   boxPoints.push_back(node->boxPos + node->boxSize - glm::vec3(0, node->boxSize.y, 0));
-   boxPoints.push_back(node->boxPos + node->boxSize - glm::vec3(0, 0, node->boxSize.z));
-   boxPoints.push_back(node->boxPos + node->boxSize);
+void BinaryTree::TakeChangedRanges(std::vector<IndexRange> &nodeRanges, std::vector<IndexRange> &pointRanges)
+{
+   nodeRanges.clear();
+   pointRanges.clear();
 
-   for (int i = 0; i < 6; i++)
+   if (m_allChanged)
    {
-      glm::vec3 diff = boxPoints[i] - point;
-      float distSqr = dot(diff, diff);
+      if (!GPUReadyBuffer.empty())
+         nodeRanges.push_back({ 0, GPUReadyBuffer.size() });
+      if (!GPUReadyPoints.empty())
+         pointRanges.push_back({ 0, GPUReadyPoints.size() });
+
+      m_changedNodes.clear();
+      m_changedPoints.clear();
+      m_allChanged = false;
+      return;
+   }
 
-      if (distSqr < radius)
+   MergeIntoRanges(m_changedNodes, nodeRanges);
+   MergeIntoRanges(m_changedPoints, pointRanges);
+}
+
+float BinaryTree::GetNodeCost(const Node &node) const
+{
+   const float area = HalfArea(node.boxSize, m_buildSettings.sphereRadius);
+   return node.pointCount > 0 ? area * node.pointCount * SAH_POINT_COST : area * SAH_NODE_COST;
+}
+
+float BinaryTree::GetTreeCost(const GPUNode *boxes) const
+{
+   if (m_nodes.size() <= ROOT_INDEX)
+      return 0.f;
+
+   // Follows the links: the unused nodes left by the updates are not part of the tree
+   float cost = 0.f;
+   std::vector<int> stack = { ROOT_INDEX };
+   while (!stack.empty())
+   {
+      const int nodeIndex = stack.back();
+      stack.pop_back();
+
+      Node node = m_nodes[nodeIndex];
+      if (boxes != nullptr)
+         node.boxSize = glm::vec3(boxes[nodeIndex].boxSize);
+      cost += GetNodeCost(node);
+      if (node.pointCount == 0 && node.left != 0)
       {
-         return true;
+         stack.push_back(node.left);
+         stack.push_back(node.right);
       }
    }
 
-   return false;
+   const glm::vec3 rootSize = boxes != nullptr ? glm::vec3(boxes[ROOT_INDEX].boxSize) : m_nodes[ROOT_INDEX].boxSize;
+   return cost / std::max(HalfArea(rootSize, m_buildSettings.sphereRadius), std::numeric_limits<float>::min());
 }
 
-int BinaryTree::Partition(std::vector<float> &vec, int low, int high)
+float BinaryTree::GetRefitQuality(const GPUNode *nodes, size_t count) const
 {
-   // Selecting last element as the pivot
-   float pivot = vec[high];
+   if (count != m_nodes.size())
+      throw std::runtime_error("Refit quality needs one box per node");
 
-   // Index of element just before the last element
-   // It is used for swapping
-   int i = (low - 1);
+   return m_builtCost > 0 ? GetTreeCost(nodes) / m_builtCost : 1.f;
+}
 
-   for (int j = low; j <= high - 1; j++)
+const std::vector<int> &BinaryTree::GetParents()
+{
+   // Kept up to date by the live updates, built here otherwise
+   if (m_parents.size() != m_nodes.size())
    {
-      // If current element is smaller than or
-      // equal to pivot
-      if (vec[j] <= pivot)
+      m_parents.assign(m_nodes.size(), 0);
+      for (size_t i = ROOT_INDEX; i < m_nodes.size(); i++)
       {
-         i++;
-         std::swap(vec[i], vec[j]);
+         const Node &node = m_nodes[i];
+         if (node.pointCount == 0 && node.left != 0)
+         {
+            m_parents[node.left] = static_cast<int>(i);
+            m_parents[node.right] = static_cast<int>(i);
+         }
       }
    }
 
-   // Put pivot to its position
-   std::swap(vec[i + 1], vec[high]);
-
-   // Return the point of partition
-   return (i + 1);
+   return m_parents;
 }
 
-void BinaryTree::QuickSort(std::vector<float> &vec, int low, int high)
+float BinaryTree::Refit(const glm::vec3 *points, size_t count, WorkStealingPool *pool)
 {
-   // Base case: This part will be executed till the starting
-   // index low is lesser than the ending index high
-   if (low < high)
+   if (count != generatedPoints.size())
+      throw std::runtime_error("Refit needs one position per point slot");
+   if (m_nodes.size() <= ROOT_INDEX)
+      return 1.f;
+
+   const std::vector<int> &parents = GetParents();
+
+   auto forRange = [pool](size_t first, size_t last, const std::function<void(size_t, size_t)> &function)
    {
-      // pi is Partitioning Index, arr[p] is now at
-      // right place
-      int pi = Partition(vec, low, high);
+      if (pool == nullptr)
+         function(first, last);
+      else
+         pool->ParallelFor(first, last, REFIT_GRAIN, function);
+   };
 
-      // Separately sort elements before and after the
-      // Partition Index pi
-      QuickSort(vec, low, pi - 1);
-      QuickSort(vec, pi + 1, high);
-   }
+   forRange(0, count, [&](size_t rangeBegin, size_t rangeEnd)
+   {
+      for (size_t i = rangeBegin; i < rangeEnd; i++)
+      {
+         generatedPoints[i] = points[i];
+         GPUReadyPoints[i] = glm::vec4(points[i], 1);
+         m_pointsX[i] = points[i].x;
+         m_pointsY[i] = points[i].y;
+         m_pointsZ[i] = points[i].z;
+      }
+   });
+
+   // Every leaf walks up from its own box: the first child done stops at its parent, the second one fits it.
+   // The counter handoff also publishes the box of the first child to the second.
+   std::unique_ptr<std::atomic<uint8_t>[]> visits = std::make_unique<std::atomic<uint8_t>[]>(m_nodes.size());
+   std::mutex mutex;
+   float cost = 0.f;
+
+   const auto writeBox = [this](int nodeIndex, glm::vec3 boxMin, glm::vec3 boxMax)
+   {
+      Node &node = m_nodes[nodeIndex];
+      node.boxPos = boxMin;
+      node.boxSize = boxMax - boxMin;
+      GPUReadyBuffer[nodeIndex].boxPos = glm::vec4(node.boxPos, -1);
+      GPUReadyBuffer[nodeIndex].boxSize = glm::vec4(node.boxSize, -1);
+   };
+
+   forRange(ROOT_INDEX, m_nodes.size(), [&](size_t rangeBegin, size_t rangeEnd)
+   {
+      float rangeCost = 0.f;
+      for (size_t i = rangeBegin; i < rangeEnd; i++)
+      {
+         const Node &leaf = m_nodes[i];
+         if (leaf.pointCount == 0)
+            continue;
+
+         glm::vec3 boxMin = generatedPoints[leaf.pointOffset];
+         glm::vec3 boxMax = boxMin;
+         for (int p = leaf.pointOffset + 1; p < leaf.pointOffset + leaf.pointCount; p++)
+         {
+            boxMin = glm::min(boxMin, generatedPoints[p]);
+            boxMax = glm::max(boxMax, generatedPoints[p]);
+         }
+         writeBox(static_cast<int>(i), boxMin, boxMax);
+         rangeCost += GetNodeCost(leaf);
+
+         for (int n = parents[i]; n != 0; n = parents[n])
+         {
+            if (visits[n].fetch_add(1, std::memory_order_acq_rel) == 0)
+               break;
+
+            const Node &left = m_nodes[m_nodes[n].left];
+            const Node &right = m_nodes[m_nodes[n].right];
+            writeBox(n, glm::min(left.boxPos, right.boxPos),
+                     glm::max(left.boxPos + left.boxSize, right.boxPos + right.boxSize));
+            rangeCost += GetNodeCost(m_nodes[n]);
+         }
+      }
+
+      std::lock_guard<std::mutex> lock(mutex);
+      cost += rangeCost;
+   });
+
+   // Every box moved
+   m_allChanged = true;
+
+   cost /= std::max(HalfArea(m_nodes[ROOT_INDEX].boxSize, m_buildSettings.sphereRadius), std::numeric_limits<float>::min());
+   return m_builtCost > 0 ? cost / m_builtCost : 1.f;
+}
+
+size_t BinaryTree::GetMemoryFootprint() const
+{
+   const auto bytes = [](const auto &vector) { return vector.capacity() * sizeof(vector[0]); };
+
+   return bytes(m_nodes) + bytes(generatedPoints) + bytes(GPUReadyBuffer) + bytes(GPUReadyPoints) + bytes(m_pointsX) +
+          bytes(m_pointsY) + bytes(m_pointsZ) + bytes(m_parents) + bytes(m_subtreePoints) + bytes(m_pointLeaves) +
+          bytes(m_freeNodes) + bytes(m_changedNodes) + bytes(m_changedPoints);
 }
@@ -3,15 +3,25 @@
 #include <glm/glm.hpp>
 
 #include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
 
 constexpr int MAX_POINTS_PER_LEAVES = 16;
 
+// Deepest generation allowed, the compute shader traversal stack (MAX_STACK_SIZE) is sized from it
+constexpr int MAX_TREE_DEPTH = 63;
+
+// SAH costs, relative to each other: visiting a node (dependent node fetch + box test) and blending one point sphere
+constexpr float SAH_NODE_COST = 4.f;
+constexpr float SAH_POINT_COST = 1.f;
+
 struct alignas(16) GPUNode {
 	glm::vec4 boxPos;         // .xyz used
 	glm::vec4 boxSize;        // .xyz used
-	glm::ivec4 children;      // .x = left, .y = right
-
-	glm::vec4 cloudPoints[16]; // .xyz = point, .w = unused
+	glm::ivec4 children;      // .x = left (first point for a leaf), .y = right, .z = skip (next node when this subtree is missed or done, 0 = end)
+	                          // .w = point count (0 for an internal node)
 };
 
 struct Node
@@ -21,16 +31,70 @@ struct Node
    glm::vec3 boxPos = glm::vec3(-1, -1, -1);
    glm::vec3 boxSize = glm::vec3(-1, -1, -1);
 
-   // Children
-   Node *left = nullptr;
-   Node *right = nullptr;
+   // Children, indices in the node arena (0 = no child)
+   int left = 0;
+   int right = 0;
 
+   // Next node in depth-first order once this subtree is missed or done
+   int skipIndex = 0;
+
+   // Heap numbering (root 1, children 2n and 2n + 1), only kept by the median builder
    int mortonNumber = 1;
 
-   //Only when leaf
-   // std::vector<glm::vec3> cloudPoints;
-   std::array<glm::vec3, MAX_POINTS_PER_LEAVES> cloudPoints;
-   // std::array<unsigned int, MAX_POINTS_PER_LEAVES> cloudPoints;
+   //Only when leaf: points [pointOffset, pointOffset + pointCount) of generatedPoints
+   int pointOffset = 0;
+   int pointCount = 0;
+};
+
+class WorkStealingPool;
+class TaskGroup;
+
+// How the hierarchy is built, every builder gives the same GPU layout
+enum TREE_BUILDER
+{
+   TREE_BUILDER_MEDIAN = 0, // median split on a round robin axis: balanced, slower to build
+   TREE_BUILDER_LBVH = 1,   // splits on the points sorted by Morton code: much faster to build, fitted boxes
+   TREE_BUILDER_SAH = 2,    // binned surface area heuristic, fitted boxes: slowest to build, fewest nodes visited per ray
+   TREE_BUILDER_COUNT
+};
+
+struct BinaryTreeBuildSettings
+{
+   int builder = TREE_BUILDER_MEDIAN;
+
+   // 0 = every hardware thread, 1 = single threaded build
+   unsigned int threadCount = 0;
+
+   // Subtrees with fewer points are built entirely by the thread that reached them
+   size_t sequentialCutoff = 1 << 12;
+
+   // Nodes with more points find their median with the parallel selection
+   size_t parallelSplitCutoff = 1 << 18;
+
+   // Median builder: below the parallel selection, nodes with more points find their median with a histogram of
+   // medianBinCount bins (0 = off, up to 256) and only select exactly inside the bin holding it. Smaller nodes select exactly.
+   int medianBinCount = 64;
+   size_t binnedSplitCutoff = 1 << 8;
+
+   // SAH builder: candidate split planes per axis are the borders of sahBinCount bins (2 to 64)
+   int sahBinCount = 16;
+
+   // SAH builder: radius of the spheres drawn around the points, rays hit the boxes grown by it
+   float sphereRadius = 0.f;
+};
+
+// Wall time of one step of a build
+struct BuildPhase
+{
+   const char *name;
+   float milliseconds;
+};
+
+// Indices [first, last)
+struct IndexRange
+{
+   size_t first;
+   size_t last;
 };
 
 std::vector<glm::vec3> FakeDataGenerator(int numberOfValues, float min = -1, float max = 1);
@@ -38,63 +102,255 @@ std::vector<glm::vec3> FakeDataGenerator(int numberOfValues, float min = -1, flo
 class BinaryTree
 {
 public:
-	BinaryTree(std::vector<glm::vec3>& pointCloudPoints);
+	BinaryTree(std::vector<glm::vec3>& pointCloudPoints, const BinaryTreeBuildSettings& buildSettings = {});
 	BinaryTree() {};
 
-   ~BinaryTree();
+   // The node arena can be big, only move it around
+   BinaryTree(const BinaryTree&) = delete;
+   BinaryTree& operator=(const BinaryTree&) = delete;
+   BinaryTree(BinaryTree&&) noexcept = default;
+   BinaryTree& operator=(BinaryTree&&) noexcept = default;
 
    std::vector<glm::vec3> generatedPoints;
 
+   // double arrays system
+   // the first one is the tree, leaves only keep an offset and a count in the second one
+   // the second one has all the points, sorted so that every leaf owns a contiguous range
    std::vector<GPUNode> GPUReadyBuffer;
+   std::vector<glm::vec4> GPUReadyPoints; // .xyz = point, .w = unused
 
-   // double arrays system
-   // the first one is the tree and the cloudpoints in the nodes are offset for the next array
-   // the second array is an array with all the points
+   // Neighbour queries, results are indices in generatedPoints (and GPUReadyPoints).
+   // Branch and bound on the box distances, nothing is allocated: safe to call from several threads at once.
+
+   // Index of the closest point, -1 if the tree is empty
+   int Nearest(glm::vec3 point, float *distanceSqr = nullptr) const;
+
+   // Nearest for count points at once: outIndices[i] (and outDistancesSqr[i] when given) for points[i].
+   // Split across the pool when one is given. Queries close to each other in the array should be close in space.
+   void NearestBatch(const glm::vec3 *points, size_t count, int *outIndices, float *outDistancesSqr = nullptr,
+                     WorkStealingPool *pool = nullptr) const;
+
+   // Fills outIndices / outDistancesSqr (k slots each) with the k closest points, nearest first.
+   // Returns how many were found (fewer than k when the cloud is smaller).
+   size_t KNearest(glm::vec3 point, size_t k, int *outIndices, float *outDistancesSqr) const;
+
+   // Every point within radius, unordered. outIndices is cleared first and its capacity reused.
+   size_t RadiusSearch(glm::vec3 point, float radius, std::vector<int> &outIndices) const;
+
+   // Live updates, for clouds that keep changing. New nodes and point slots are appended or reuse freed ones,
+   // so the depth-first layout is given up: every traversal follows the explicit links and keeps working.
+   // Point indices returned by the queries stay valid until the next update. Not safe to run along queries.
+
+   // Adds the points one by one, each down to the child whose box grows the least. A full leaf splits in two,
+   // a subtree that gets too unbalanced is rebuilt so the depth stays logarithmic.
+   void Insert(const glm::vec3 *points, size_t count);
+
+   // Removes one point at each of these positions (exact match), returns how many were found.
+   // A leaf merges with its sibling leaf once they fit together in half a leaf, an empty one gives its place to its sibling.
+   size_t Remove(const glm::vec3 *points, size_t count);
+
+   // Points in the tree, generatedPoints also holds the unused slots left by the updates
+   size_t GetPointCount() const { return m_pointCount; }
+
+   // Back to the depth-first layout without unused nodes or point slots, everything is marked changed.
+   // Runs by itself once most point slots are unused. PackCompactTree, PackWideTree and ReorderNodes need it after updates.
+   void Compact();
+   bool IsDepthFirst() const { return m_depthFirst; }
+
+   // GPUReadyBuffer / GPUReadyPoints entries written by the updates since the last call, sorted and merged.
+   // The arrays may have grown, the new entries are in the ranges too.
+   void TakeChangedRanges(std::vector<IndexRange> &nodeRanges, std::vector<IndexRange> &pointRanges);
+
+   // Moves every point: points[i] is the new position of generatedPoints[i], count has to be generatedPoints.size().
+   // The topology stays, leaf then internal boxes are fitted again bottom-up, split across the pool when one is given.
+   // Returns the SAH cost of the refitted tree over the one of the tree as built or left by the last Insert / Remove,
+   // past REFIT_REBUILD_RATIO a rebuild pays.
+   float Refit(const glm::vec3 *points, size_t count, WorkStealingPool *pool = nullptr);
+   static constexpr float REFIT_REBUILD_RATIO = 1.5f;
 
-   //TODO define sizes better
-   // size is 2^(gen+1) -1
-   // on order avec les morton number -> index
-   // std::array<Node, 1> ToGPUArrayTree;
+   // Same ratio as Refit for boxes fitted elsewhere (refit.comp): nodes is GPUReadyBuffer with moved boxes, same topology
+   float GetRefitQuality(const GPUNode *nodes, size_t count) const;
 
-   //TODO opti ? on pre-tri les elements?
-   // size is number of point of pointcloud
-   // les nodes font ref a des index de cet array
-   // std::array<glm::vec3, 1> ToGPUArrayPoints;
+   // Parent of every node, 0 for the root and unused nodes. For a refit done elsewhere (refit.comp).
+   const std::vector<int> &GetParents();
+
+   // Steps of the build in order, the last one fills the GPU arrays
+   const std::vector<BuildPhase> &GetBuildPhases() const { return m_buildPhases; }
+
+   // Bytes held on the CPU: nodes, points, GPU arrays, query copies and live update state
+   size_t GetMemoryFootprint() const;
 
 private:
 
    // USELESS ?
    glm::vec3* FillGPUPointsArray(std::vector<glm::vec3>& pointCloudPoints);
-   std::vector<Node> FillGPUArray(Node* root, std::vector<glm::vec3>& pointCloudPoints);
-   void FillGPUArrayRecursive(Node *node, std::vector<glm::vec3>& pointCloudPoints, std::vector<Node>& toReturn);
 
 
-   std::vector<glm::vec3> GetBox(std::vector<glm::vec3> data);
+   // Box of generatedPoints[first, last): [0] = min corner, [1] = size
+   std::array<glm::vec3, 2> GetBox(size_t first, size_t last) const;
+
+   // Number of generations needed to have at most MAX_POINTS_PER_LEAVES points per leaf
+   static int GetGeneration(size_t pointCount);
+
+   // Throws if a median split tree over pointCount points would exceed MAX_TREE_DEPTH (the shader traversal stack)
+   static void CheckTreeDepth(size_t pointCount);
+
+   // Nodes in the subtree built over pointCount points (splits are by count, so it only depends on it)
+   static size_t GetSubtreeNodeCount(size_t pointCount);
 
    // Node* GetNodeFromMorton(int mortonNumber, Node* _root);
 
-   std::vector<std::vector<glm::vec3> > FillUpTree(const std::vector<glm::vec3> &data, Node *node, int deepness);
-   void FillUpTreeRecursive(const std::vector<glm::vec3> &data, Node *node, int deepness);
+   void BuildMedianSplit();
+   void BuildLBVH();
+   void BuildSAH();
+
+   // Runs function(rangeBegin, rangeEnd) over [first, last), split across the pool when there is one
+   void ForRange(size_t first, size_t last, const std::function<void(size_t, size_t)> &function);
+
+   // Builds in place on generatedPoints: each node owns the range [first, last) and splits it around its slice.
+   // Nodes are written straight at their depth-first index, with a group big subtrees are forked as tasks.
+   // inScratch: the points of [first, last) are in m_scratchPoints (left there by a binned selection).
+   void FillUpTreeRecursive(size_t first, size_t last, int nodeIndex, int deepness, TaskGroup *group, bool inScratch = false);
+
+   void PrintNode(const Node &node);
+   void PrintNodeRecursive(int nodeIndex);
+
+   // Partitions [first, last) around its median on the deepness axis, returns the slice and the split index in mid.
+   // [axisMin, axisMax] bounds the points on that axis (the node box). inScratch is updated to where the points are now.
+   float FindOptimalSlice(size_t first, size_t last, int deepness, float axisMin, float axisMax, size_t &mid, bool &inScratch);
+
+   // Same contract as std::nth_element on axis, returns the highest value before nth. One pass bins the points
+   // between axisMin and axisMax, a second one scatters them around the bin holding nth into the other array
+   // (generatedPoints <-> m_scratchPoints, inScratch flips), then only that bin is selected.
+   float BinnedSelect(size_t first, size_t last, size_t nth, int axis, float axisMin, float axisMax, bool &inScratch);
+
+   // Parallel quickselect for the top levels: places the nth point of [first, last) on axis with everything
+   // before it lower or equal and everything after it greater or equal
+   void ParallelSelect(size_t first, size_t last, size_t nth, int axis);
+   float ParallelMaxOnAxis(size_t first, size_t last, int axis);
+
+   // Appends the subtree of the Morton sorted points [first, last) in depth-first order, returns its index
+   int EmitLBVHRecursive(const std::vector<uint32_t> &codes, size_t first, size_t last, int deepness);
+
+   // Split on the highest bit where the codes of [first, last) differ, by count when they are all equal
+   // or when the subtree could not fit under MAX_TREE_DEPTH anymore
+   static size_t FindMortonSplit(const std::vector<uint32_t> &codes, size_t first, size_t last, int deepness);
+
+   // Appends the subtree of the points [first, last) split with the SAH in depth-first order, returns its index
+   int EmitSAHRecursive(size_t first, size_t last, const std::array<glm::vec3, 2> &box, int deepness);
+
+   // Partitions [first, last) on the cheapest bin border, returns the split index (first if there is no border to split on).
+   // The fitted boxes of both sides come from the bins.
+   size_t FindSAHSplit(size_t first, size_t last, const std::array<glm::vec3, 2> &box, float &cost,
+                       std::array<std::array<glm::vec3, 2>, 2> &childBoxes);
+
+   // Median split on the longest axis of box
+   size_t SplitByCount(size_t first, size_t last, const std::array<glm::vec3, 2> &box,
+                       std::array<std::array<glm::vec3, 2>, 2> &childBoxes);
+
+   BinaryTreeBuildSettings m_buildSettings;
+
+   std::vector<BuildPhase> m_buildPhases;
+   std::chrono::steady_clock::time_point m_phaseStart;
+
+   // Records the time since the end of the previous phase
+   void EndBuildPhase(const char *name);
+
+   // Only set during a parallel build
+   WorkStealingPool *m_pool = nullptr;
+   std::vector<glm::vec3> m_scratchPoints;
+
+   // Node arena in depth-first order, the same order as GPUReadyBuffer.
+   // Index 0 stays unused so that 0 can mean "no child" / "end of traversal", the root is at ROOT_INDEX.
+   static constexpr int ROOT_INDEX = 1;
+   std::vector<Node> m_nodes;
+
+   // generatedPoints again, one array per axis, for the leaf distance kernels.
+   // Padded so a kernel can load whole vectors past the last point.
+   static constexpr size_t SOA_PADDING = 8;
+   std::vector<float> m_pointsX;
+   std::vector<float> m_pointsY;
+   std::vector<float> m_pointsZ;
+
+   // Queries per NearestBatch task
+   static constexpr size_t NEAREST_BATCH_GRAIN = 256;
+
+   // Points or nodes per Refit task
+   static constexpr size_t REFIT_GRAIN = 1 << 12;
+
+   // SAH cost of the tree as built or last updated, relative to its root box, Refit compares against it
+   float m_builtCost = 0.f;
+   float GetNodeCost(const Node &node) const;
+   // Boxes taken from the GPU nodes when given, from m_nodes otherwise
+   float GetTreeCost(const GPUNode *boxes = nullptr) const;
+
+   static bool CheckBoxSphereIntersection(const Node &node, glm::vec3 point, float radius);
+
+   // Nearest, the search starts bounded by the distance to the point guess (-1 = no guess)
+   int NearestFrom(glm::vec3 point, int guess, float &distanceSqr) const;
+
+   // Points of the subtree under nodeIndex are generatedPoints[first, last), only in the depth-first layout
+   void GetSubtreePointRange(int nodeIndex, size_t &first, size_t &last) const;
+
+   // GPUReadyBuffer, GPUReadyPoints and the SoA copy from m_nodes and generatedPoints
+   void FillGPUArrays();
+
+   // GPUReadyBuffer[nodeIndex] from m_nodes[nodeIndex], recorded as changed once updates started
+   void WriteGPUNode(int nodeIndex);
+
+   // Live updates: false from the first update to the next Compact()
+   bool m_depthFirst = true;
+   size_t m_pointCount = 0;
+
+   // Built by PrepareUpdates
+   std::vector<int> m_parents;       // 0 for the root and unused nodes
+   std::vector<int> m_subtreePoints; // points under each node, for the balance checks
+   std::vector<int> m_pointLeaves;   // leaf owning each point slot, 0 for an unused slot
+   std::vector<int> m_freeNodes;     // unused node indices, taken before the arena grows
+   size_t m_freePointSlots = 0;
+
+   std::vector<int> m_changedNodes;
+   std::vector<size_t> m_changedPoints;
+   bool m_allChanged = false;
+
+   // A subtree is rebuilt when one child holds more than this share of its points
+   static constexpr float MAX_CHILD_SHARE = 0.75f;
+
+   void PrepareUpdates();
+   void InsertPoint(glm::vec3 point);
+   bool RemovePoint(glm::vec3 point);
 
-   void CreateStructureNodes(int CurrGen, int maxGen, Node *node, int currentMortenNumber);
+   int AllocateNode();
+   void FreeNode(int nodeIndex);
 
-   void PrintNode(const Node *node);
-   void PrintNodeRecursive(Node *node);
+   // Appends count unused slots to the point arrays, returns the first one
+   size_t AllocatePointSlots(size_t count);
+   void SetPoint(size_t slot, glm::vec3 point, int leafIndex);
+   void FreePointSlot(size_t slot);
 
-   float FindOptimalSlice(std::vector<glm::vec3> data, int deepness);
+   // Moves the points of a leaf to new slots at the end, with room for a full leaf
+   void RelocateLeaf(int leafIndex);
 
-   Node *root;
+   void SplitLeaf(int leafIndex, glm::vec3 point);
+   void MergeLeaves(int parentIndex);
 
-   Node* GetNearestBoxesRecursive(glm::vec3 point, float radius, int deepness, Node* node);
+   // parentIndex takes the place and the content of keptChild, its other child is gone
+   void CollapseIntoParent(int parentIndex, int keptChild);
 
-   glm::vec3 GetNearestPoint(glm::vec3 point, float radius, int deepness, Node* node);
+   // Boxes fitted again from nodeIndex up to the root, stops where nothing changes
+   void RefitUpwards(int nodeIndex);
 
-   bool CheckBoxSphereIntersection(Node *node, glm::vec3 point, float radius);
+   // Lowest ancestor of nodeIndex with a child holding more than MAX_CHILD_SHARE of its points, the root if none
+   int FindScapegoat(int nodeIndex) const;
 
-   std::vector<glm::vec3> GetPointsInBoxRecursive(Node* node, std::vector<glm::vec3> points);
+   // Median splits over the points of the subtree (and extraPoint), its root index stays, the other nodes are new
+   void RebuildSubtree(int nodeIndex, const glm::vec3 *extraPoint = nullptr);
+   void EmitRebuiltRecursive(size_t first, size_t last, int nodeIndex, int skipIndex);
 
-   // Quick sort algorythm
-   int Partition(std::vector<float> &vec, int low, int high);
+   // Appends the subtree under nodeIndex to nodes / points in depth-first order
+   void CompactRecursive(int nodeIndex, std::vector<Node> &nodes, std::vector<glm::vec3> &points) const;
 
-   void QuickSort(std::vector<float> &vec, int low, int high);
+   // Leaves deeper than this get their subtree rebuilt: twice a balanced tree, or the built tree if it was deeper
+   int GetDepthLimit() const;
+   int m_builtDepth = 0;
 };
\ No newline at end of file
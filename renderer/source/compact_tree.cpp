@@ -0,0 +1,112 @@
+#include "compact_tree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+namespace
+{
+   constexpr uint32_t QUANT_MAX = 0xFFFF;
+
+   // Same arithmetic as fetchNode in the shader
+   float Decode(float min, float step, uint32_t quant)
+   {
+      return min + static_cast<float>(quant) * step;
+   }
+
+   // Largest step whose decoded value is still lower or equal to value
+   uint32_t QuantizeDown(float value, float min, float step)
+   {
+      if (step <= 0)
+         return 0;
+
+      uint32_t quant = static_cast<uint32_t>(std::clamp(std::floor((value - min) / step), 0.f, static_cast<float>(QUANT_MAX)));
+      while (quant > 0 && Decode(min, step, quant) > value)
+         quant--;
+
+      return quant;
+   }
+
+   // Smallest step whose decoded value is still greater or equal to value
+   uint32_t QuantizeUp(float value, float min, float step)
+   {
+      if (step <= 0)
+         return 0;
+
+      uint32_t quant = static_cast<uint32_t>(std::clamp(std::ceil((value - min) / step), 0.f, static_cast<float>(QUANT_MAX)));
+      while (quant < QUANT_MAX && Decode(min, step, quant) < value)
+         quant++;
+
+      return quant;
+   }
+}
+
+CompactTree PackCompactTree(const GPUNode* nodes, size_t nodeCount, const glm::vec4* points, size_t pointCount)
+{
+   if (nodeCount > COMPACT_INDEX_MASK || pointCount > COMPACT_INDEX_MASK)
+      throw std::runtime_error("Tree too large for the compact node format");
+
+   CompactTree tree;
+   tree.nodes.resize(nodeCount, GPUCompactNode{ glm::uvec4(0) });
+   tree.points.resize(pointCount, glm::uvec2(0));
+
+   // Index 0 is unused, the root is at 1
+   if (nodeCount <= 1)
+      return tree;
+
+   // One step of slack so that rounding never pushes the root max out of range
+   tree.quantMin = glm::vec3(nodes[1].boxPos);
+   for (int axis = 0; axis < 3; axis++)
+      tree.quantStep[axis] = nodes[1].boxSize[axis] > 0 ? nodes[1].boxSize[axis] / static_cast<float>(QUANT_MAX - 1) : 0.f;
+
+   for (size_t i = 1; i < nodeCount; i++)
+   {
+      const glm::ivec4& children = nodes[i].children;
+      const bool isLeaf = children.w > 0;
+
+      // The left child and the skip of a leaf are implicit, the depth-first layout has to hold
+      const int next = i + 1 < nodeCount ? static_cast<int>(i + 1) : 0;
+      if (isLeaf ? children.z != next : (children.x != next || i + 1 >= nodeCount || children.y != nodes[i + 1].children.z))
+         throw std::runtime_error("Compact node format needs the depth-first node layout");
+      if (children.w > static_cast<int>(~uint32_t(0) >> COMPACT_COUNT_SHIFT))
+         throw std::runtime_error("Leaf too large for the compact node format");
+
+      glm::uvec3 quantMin;
+      glm::uvec3 quantMax;
+      for (int axis = 0; axis < 3; axis++)
+      {
+         quantMin[axis] = QuantizeDown(nodes[i].boxPos[axis], tree.quantMin[axis], tree.quantStep[axis]);
+         quantMax[axis] = QuantizeUp(nodes[i].boxPos[axis] + nodes[i].boxSize[axis], tree.quantMin[axis], tree.quantStep[axis]);
+      }
+
+      const uint32_t link = static_cast<uint32_t>(isLeaf ? children.x : children.z);
+      tree.nodes[i].data = glm::uvec4(quantMin.x | quantMin.y << 16, quantMin.z | quantMax.x << 16, quantMax.y | quantMax.z << 16,
+                                      static_cast<uint32_t>(children.w) << COMPACT_COUNT_SHIFT | link);
+
+      if (!isLeaf)
+         continue;
+
+      // Points are relative to the decoded leaf box, as the shader sees it
+      glm::vec3 leafMin;
+      glm::vec3 leafMax;
+      for (int axis = 0; axis < 3; axis++)
+      {
+         leafMin[axis] = Decode(tree.quantMin[axis], tree.quantStep[axis], quantMin[axis]);
+         leafMax[axis] = Decode(tree.quantMin[axis], tree.quantStep[axis], quantMax[axis]);
+      }
+      const glm::vec3 leafStep = (leafMax - leafMin) / static_cast<float>(QUANT_MAX);
+
+      for (int p = children.x; p < children.x + children.w; p++)
+      {
+         glm::uvec3 quant;
+         for (int axis = 0; axis < 3; axis++)
+         {
+            const float steps = leafStep[axis] > 0 ? std::round((points[p][axis] - leafMin[axis]) / leafStep[axis]) : 0.f;
+            quant[axis] = static_cast<uint32_t>(std::clamp(steps, 0.f, static_cast<float>(QUANT_MAX)));
+         }
+         tree.points[p] = glm::uvec2(quant.x | quant.y << 16, quant.z);
+      }
+   }
+
+   return tree;
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "binaryTree.h"
+
+// GPUCompactNode::data.w: point count in the top bits, an index below
+constexpr int COMPACT_COUNT_SHIFT = 27;
+constexpr uint32_t COMPACT_INDEX_MASK = (uint32_t(1) << COMPACT_COUNT_SHIFT) - 1;
+
+// 16 bytes instead of the 48 of GPUNode
+struct alignas(16) GPUCompactNode
+{
+   glm::uvec4 data;
+   // .x = min x | min y << 16, .y = min z | max x << 16, .z = max y | max z << 16: box corners in 16 bits steps of the root box
+   // .w = point count << COMPACT_COUNT_SHIFT (0 for an internal node) | first point (leaf) or skip index (internal node)
+   // The left child and the skip of a leaf are always the next node, the right child is the skip of the left one.
+};
+
+// Compact encoding of GPUReadyBuffer / GPUReadyPoints, decoded by the compute shader built with COMPACT_NODES
+struct CompactTree
+{
+   // Node box corners are quantMin + q * quantStep
+   glm::vec3 quantMin = glm::vec3(0);
+   glm::vec3 quantStep = glm::vec3(0);
+
+   std::vector<GPUCompactNode> nodes;
+
+   // 16 bits steps of the leaf box: .x = x | y << 16, .y = z. 8 bytes instead of 16.
+   std::vector<glm::uvec2> points;
+};
+
+// Boxes are rounded outwards so they still hold their points once decoded.
+// Throws std::runtime_error when the tree is too big for the index bits or not in depth-first order.
+CompactTree PackCompactTree(const GPUNode* nodes, size_t nodeCount, const glm::vec4* points, size_t pointCount);
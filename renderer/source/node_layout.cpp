@@ -0,0 +1,156 @@
+#include "node_layout.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <stdexcept>
+
+namespace
+{
+   bool IsLeaf(const GPUNode& node)
+   {
+      return node.children.w > 0;
+   }
+
+   // Gives the next indices to the treelet at the top of the subtree under root (breadth-first, siblings together),
+   // then to the subtrees hanging below it, left to right
+   void LayoutTreeletRecursive(const GPUNode* nodes, int root, int treeletSize, std::vector<int>& newIndex, int& nextIndex)
+   {
+      int treelet[64];
+      int treeletCount = 0;
+      treelet[treeletCount++] = root;
+
+      for (int i = 0; i < treeletCount && treeletCount + 2 <= treeletSize; i++)
+      {
+         if (IsLeaf(nodes[treelet[i]]))
+            continue;
+
+         treelet[treeletCount++] = nodes[treelet[i]].children.x;
+         treelet[treeletCount++] = nodes[treelet[i]].children.y;
+      }
+
+      for (int i = 0; i < treeletCount; i++)
+         newIndex[treelet[i]] = nextIndex++;
+
+      for (int i = 0; i < treeletCount; i++)
+      {
+         const GPUNode& node = nodes[treelet[i]];
+         if (IsLeaf(node))
+            continue;
+
+         for (const int child : { node.children.x, node.children.y })
+         {
+            if (newIndex[child] == 0)
+               LayoutTreeletRecursive(nodes, child, treeletSize, newIndex, nextIndex);
+         }
+      }
+   }
+
+   // Same test as intersectRayAABB in the shader
+   bool IntersectRayBox(glm::vec3 origin, glm::vec3 inverseDirection, const GPUNode& node, float grow)
+   {
+      const glm::vec3 boxMin = glm::vec3(node.boxPos) - grow;
+      const glm::vec3 boxMax = glm::vec3(node.boxPos) + glm::vec3(node.boxSize) + grow;
+
+      const glm::vec3 t0 = (boxMin - origin) * inverseDirection;
+      const glm::vec3 t1 = (boxMax - origin) * inverseDirection;
+      const glm::vec3 tSmaller = glm::min(t0, t1);
+      const glm::vec3 tBigger = glm::max(t0, t1);
+
+      const float tMin = std::max(std::max(tSmaller.x, tSmaller.y), tSmaller.z);
+      const float tMax = std::min(std::min(tBigger.x, tBigger.y), tBigger.z);
+      return tMax >= std::max(tMin, 0.f);
+   }
+}
+
+std::vector<GPUNode> ReorderNodes(const GPUNode* nodes, size_t nodeCount, int layout, int treeletSize)
+{
+   std::vector<GPUNode> reordered(nodes, nodes + nodeCount);
+   if (layout == NODE_LAYOUT_DEPTH_FIRST || nodeCount <= 1)
+      return reordered;
+
+   if (layout != NODE_LAYOUT_TREELET)
+      throw std::runtime_error("Unknown node layout");
+
+   // The treelet has to fit the fixed array of LayoutTreeletRecursive
+   treeletSize = std::clamp(treeletSize, 1, 63);
+
+   // newIndex[old] = new, 0 = not placed yet (0 is never a child)
+   std::vector<int> newIndex(nodeCount, 0);
+   int nextIndex = 1;
+   LayoutTreeletRecursive(nodes, 1, treeletSize, newIndex, nextIndex);
+
+   if (static_cast<size_t>(nextIndex) != nodeCount)
+      throw std::runtime_error("Node layout did not reach every node of the tree");
+
+   for (size_t i = 1; i < nodeCount; i++)
+   {
+      GPUNode node = nodes[i];
+      if (!IsLeaf(node))
+      {
+         node.children.x = newIndex[node.children.x];
+         node.children.y = newIndex[node.children.y];
+      }
+      node.children.z = node.children.z > 0 ? newIndex[node.children.z] : 0;
+
+      reordered[newIndex[i]] = node;
+   }
+
+   return reordered;
+}
+
+float MeasureCacheLinesPerRay(const GPUNode* nodes, size_t nodeCount, float sphereRadius, size_t rayCount, size_t lineSize)
+{
+   if (nodeCount <= 1 || rayCount == 0)
+      return 0.f;
+
+   const glm::vec3 boxMin = glm::vec3(nodes[1].boxPos);
+   const glm::vec3 boxSize = glm::vec3(nodes[1].boxSize);
+   const glm::vec3 center = boxMin + boxSize * 0.5f;
+   const float distance = std::max(glm::length(boxSize), 1e-6f);
+
+   // Fixed seed, the same rays for every layout
+   uint32_t state = 0x9E3779B9u;
+   const auto random = [&state]()
+   {
+      state = state * 1664525u + 1013904223u;
+      return static_cast<float>(state >> 8) / static_cast<float>(1u << 24);
+   };
+
+   // Last ray that read each line, so every line counts once per ray
+   std::vector<uint32_t> lineRay((nodeCount * sizeof(GPUNode) + lineSize - 1) / lineSize, UINT32_MAX);
+   size_t lineCount = 0;
+
+   for (uint32_t ray = 0; ray < rayCount; ray++)
+   {
+      // From a random point around the cloud towards the center of a random node, mostly a leaf
+      const glm::vec3 direction = glm::normalize(glm::vec3(random(), random(), random()) * 2.f - 1.f + glm::vec3(1e-4f));
+      const glm::vec3 origin = center + direction * distance;
+      const GPUNode& target = nodes[1 + static_cast<size_t>(random() * static_cast<float>(nodeCount - 2))];
+      const glm::vec3 rayDirection = glm::normalize(glm::vec3(target.boxPos) + glm::vec3(target.boxSize) * 0.5f - origin);
+      const glm::vec3 inverseDirection = 1.f / rayDirection;
+
+      int nodeIndex = 1;
+      while (nodeIndex > 0)
+      {
+         // A node can straddle two lines
+         const size_t firstByte = static_cast<size_t>(nodeIndex) * sizeof(GPUNode);
+         for (size_t line = firstByte / lineSize; line <= (firstByte + sizeof(GPUNode) - 1) / lineSize; line++)
+         {
+            if (lineRay[line] != ray)
+            {
+               lineRay[line] = ray;
+               lineCount++;
+            }
+         }
+
+         const GPUNode& node = nodes[nodeIndex];
+         if (!IntersectRayBox(origin, inverseDirection, node, sphereRadius) || IsLeaf(node))
+            nodeIndex = node.children.z;
+         else
+            nodeIndex = node.children.x;
+      }
+   }
+
+   return static_cast<float>(lineCount) / static_cast<float>(rayCount);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+
+#include "binaryTree.h"
+
+// Order of GPUReadyBuffer in the node SSBO, the links are remapped so every traversal walks it the same way
+enum NODE_LAYOUT
+{
+   NODE_LAYOUT_DEPTH_FIRST = 0, // as built: a left child right after its parent, every subtree is one contiguous range
+   NODE_LAYOUT_TREELET = 1,     // the top levels of each subtree packed together, then its lower subtrees the same way
+   NODE_LAYOUT_COUNT
+};
+
+// Nodes per treelet, 3 full levels. Both children of a node always share their treelet.
+constexpr int DEFAULT_TREELET_SIZE = 7;
+
+// Copy of nodes[0, nodeCount) in the given layout, node 0 stays unused and the root stays at 1
+std::vector<GPUNode> ReorderNodes(const GPUNode* nodes, size_t nodeCount, int layout, int treeletSize = DEFAULT_TREELET_SIZE);
+
+// Average count of distinct lineSize bytes lines of the node array read by the stackless ray traversal of
+// basic_Raymarching.comp (traverseBVH), over rayCount rays shot at the cloud from around it. Always the same rays.
+float MeasureCacheLinesPerRay(const GPUNode* nodes, size_t nodeCount, float sphereRadius, size_t rayCount = 256,
+                              size_t lineSize = 128);
@@ -0,0 +1,102 @@
+#include "radix_sort.h"
+
+#include <algorithm>
+#include <array>
+#include <functional>
+#include <stdexcept>
+
+#include "work_stealing_pool.h"
+
+namespace
+{
+   constexpr int RADIX_BITS = 11;
+   constexpr size_t RADIX_SIZE = size_t(1) << RADIX_BITS;
+
+   // Below this many keys per chunk, splitting the work costs more than it saves
+   constexpr size_t MIN_KEYS_PER_CHUNK = 1 << 14;
+
+   void ForEachChunk(WorkStealingPool* pool, size_t chunkCount, const std::function<void(size_t)>& function)
+   {
+      if (pool == nullptr || chunkCount == 1)
+      {
+         for (size_t chunk = 0; chunk < chunkCount; chunk++)
+            function(chunk);
+         return;
+      }
+
+      pool->ParallelFor(0, chunkCount, 1, [&function](size_t chunkBegin, size_t chunkEnd)
+      {
+         for (size_t chunk = chunkBegin; chunk < chunkEnd; chunk++)
+            function(chunk);
+      });
+   }
+}
+
+void RadixSort(std::vector<uint64_t>& keys, int firstBit, int lastBit, WorkStealingPool* pool)
+{
+   if (firstBit < 0 || lastBit > 64 || firstBit > lastBit)
+      throw std::runtime_error("RadixSort: invalid bit range");
+
+   const size_t count = keys.size();
+   if (count < 2)
+      return;
+
+   size_t chunkCount = 1;
+   if (pool != nullptr)
+      chunkCount = std::clamp<size_t>(count / MIN_KEYS_PER_CHUNK, 1, pool->GetThreadCount() * 4);
+   const size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+
+   std::vector<uint64_t> keysScratch(count);
+
+   // One histogram per chunk, turned into the write offsets of that chunk
+   std::vector<std::array<size_t, RADIX_SIZE>> offsets(chunkCount);
+
+   for (int shift = firstBit; shift < lastBit; shift += RADIX_BITS)
+   {
+      // The last pass may be narrower
+      const uint64_t digitMask = (uint64_t(1) << std::min(RADIX_BITS, lastBit - shift)) - 1;
+
+      ForEachChunk(pool, chunkCount, [&](size_t chunk)
+      {
+         std::array<size_t, RADIX_SIZE>& histogram = offsets[chunk];
+         histogram.fill(0);
+
+         const size_t end = std::min(count, (chunk + 1) * chunkSize);
+         for (size_t i = chunk * chunkSize; i < end; i++)
+            histogram[(keys[i] >> shift) & digitMask]++;
+      });
+
+      // Every key has the same digit: nothing moves
+      size_t digitTotal = 0;
+      for (size_t chunk = 0; chunk < chunkCount; chunk++)
+         digitTotal += offsets[chunk][(keys[0] >> shift) & digitMask];
+      if (digitTotal == count)
+         continue;
+
+      // Digit major, chunk minor: keeps the sort stable
+      size_t offset = 0;
+      for (size_t digit = 0; digit < RADIX_SIZE; digit++)
+      {
+         for (size_t chunk = 0; chunk < chunkCount; chunk++)
+         {
+            const size_t digitCount = offsets[chunk][digit];
+            offsets[chunk][digit] = offset;
+            offset += digitCount;
+         }
+      }
+
+      ForEachChunk(pool, chunkCount, [&](size_t chunk)
+      {
+         std::array<size_t, RADIX_SIZE>& chunkOffsets = offsets[chunk];
+
+         const size_t end = std::min(count, (chunk + 1) * chunkSize);
+         for (size_t i = chunk * chunkSize; i < end; i++)
+         {
+            const size_t destination = chunkOffsets[(keys[i] >> shift) & digitMask]++;
+            keysScratch[destination] = keys[i];
+         }
+      });
+
+      keys.swap(keysScratch);
+   }
+}
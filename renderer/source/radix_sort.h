@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class WorkStealingPool;
+
+// Stable LSD radix sort of keys on their bits [firstBit, lastBit), 11 bits per pass.
+// The other bits are carried along, so a payload (an index...) can be packed in the low bits.
+// Passes where every key has the same digit are skipped.
+// Chunks of the array are histogrammed and scattered in parallel when a pool is given.
+void RadixSort(std::vector<uint64_t>& keys, int firstBit = 0, int lastBit = 64, WorkStealingPool* pool = nullptr);
@@ -0,0 +1,274 @@
+#include "tree_cache.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+   constexpr char TREE_CACHE_MAGIC[8] = { 'P', 'R', 'M', 'T', 'R', 'E', 'E', '\0' };
+   constexpr uint64_t TREE_CACHE_ALIGNMENT = 16;
+
+   constexpr uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+   constexpr uint64_t FNV_PRIME = 1099511628211ull;
+
+   uint64_t AlignUp(uint64_t value)
+   {
+      return (value + TREE_CACHE_ALIGNMENT - 1) / TREE_CACHE_ALIGNMENT * TREE_CACHE_ALIGNMENT;
+   }
+
+   // Only the settings that change the built tree, the SAH ones only matter to the SAH builder
+   bool IsSameTree(const TreeCacheHeader& header, const BinaryTreeBuildSettings& settings)
+   {
+      if (header.builder != settings.builder)
+         return false;
+
+      if (settings.builder == TREE_BUILDER_SAH)
+         return header.sahBinCount == settings.sahBinCount && header.sphereRadius == settings.sphereRadius;
+
+      return true;
+   }
+}
+
+#pragma region MAPPED FILE
+MappedFile::~MappedFile()
+{
+   Close();
+}
+
+bool MappedFile::Open(const std::string& path)
+{
+   Close();
+
+#ifdef _WIN32
+   HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+   if (file == INVALID_HANDLE_VALUE)
+      return false;
+
+   LARGE_INTEGER fileSize;
+   if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0)
+   {
+      CloseHandle(file);
+      return false;
+   }
+
+   HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+   if (mapping == nullptr)
+   {
+      CloseHandle(file);
+      return false;
+   }
+
+   const void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+   if (data == nullptr)
+   {
+      CloseHandle(mapping);
+      CloseHandle(file);
+      return false;
+   }
+
+   m_file = file;
+   m_mapping = mapping;
+   m_data = static_cast<const uint8_t*>(data);
+   m_size = static_cast<size_t>(fileSize.QuadPart);
+#else
+   const int file = open(path.c_str(), O_RDONLY);
+   if (file < 0)
+      return false;
+
+   struct stat fileStat;
+   if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0)
+   {
+      close(file);
+      return false;
+   }
+
+   void* data = mmap(nullptr, static_cast<size_t>(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+
+   // The mapping keeps the file alive
+   close(file);
+
+   if (data == MAP_FAILED)
+      return false;
+
+   m_data = static_cast<const uint8_t*>(data);
+   m_size = static_cast<size_t>(fileStat.st_size);
+#endif
+
+   return true;
+}
+
+void MappedFile::Close()
+{
+   if (m_data == nullptr)
+      return;
+
+#ifdef _WIN32
+   UnmapViewOfFile(m_data);
+   CloseHandle(m_mapping);
+   CloseHandle(m_file);
+   m_mapping = nullptr;
+   m_file = nullptr;
+#else
+   munmap(const_cast<uint8_t*>(m_data), m_size);
+#endif
+
+   m_data = nullptr;
+   m_size = 0;
+}
+#pragma endregion
+
+#pragma region TREE CACHE
+std::string TreeCache::GetCachePath(const std::string& modelPath)
+{
+   return std::filesystem::path(modelPath).replace_extension(".tree").string();
+}
+
+uint64_t TreeCache::HashFile(const std::string& path, uint64_t& size)
+{
+   MappedFile file;
+   if (!file.Open(path))
+   {
+      size = 0;
+      return 0;
+   }
+
+   // FNV-1a over 64 bits words: the hash runs at memory speed even on multi GB scans
+   const uint8_t* data = file.GetData();
+   size = file.GetSize();
+
+   uint64_t hash = FNV_OFFSET_BASIS;
+   size_t i = 0;
+   for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+   {
+      uint64_t word;
+      std::memcpy(&word, data + i, sizeof(uint64_t));
+      hash = (hash ^ word) * FNV_PRIME;
+   }
+   for (; i < size; i++)
+      hash = (hash ^ data[i]) * FNV_PRIME;
+
+   return hash;
+}
+
+void TreeCache::Write(const std::string& cachePath, uint64_t sourceHash, uint64_t sourceSize,
+                      const BinaryTreeBuildSettings& settings, const BinaryTree& tree)
+{
+   TreeCacheHeader header{};
+   std::memcpy(header.magic, TREE_CACHE_MAGIC, sizeof(TREE_CACHE_MAGIC));
+   header.version = TREE_CACHE_VERSION;
+   header.headerSize = sizeof(TreeCacheHeader);
+   header.sourceHash = sourceHash;
+   header.sourceSize = sourceSize;
+   header.builder = settings.builder;
+   header.sahBinCount = settings.sahBinCount;
+   header.sphereRadius = settings.sphereRadius;
+   header.gpuNodeSize = sizeof(GPUNode);
+   header.maxPointsPerLeaf = MAX_POINTS_PER_LEAVES;
+   header.maxTreeDepth = MAX_TREE_DEPTH;
+   header.nodeCount = tree.GPUReadyBuffer.size();
+   header.pointCount = tree.GPUReadyPoints.size();
+   header.nodeOffset = AlignUp(sizeof(TreeCacheHeader));
+   header.pointOffset = AlignUp(header.nodeOffset + sizeof(GPUNode) * header.nodeCount);
+
+   // The root box is the box of the whole cloud
+   if (tree.GPUReadyBuffer.size() > 1)
+   {
+      const GPUNode& root = tree.GPUReadyBuffer[1];
+      for (int axis = 0; axis < 3; axis++)
+      {
+         header.boundsMin[axis] = root.boxPos[axis];
+         header.boundsMax[axis] = root.boxPos[axis] + root.boxSize[axis];
+      }
+   }
+
+   // Never leave a half written cache behind: write aside, then swap it in
+   const std::string temporaryPath = cachePath + ".tmp";
+   {
+      std::ofstream file(temporaryPath, std::ios::binary | std::ios::trunc);
+      if (!file)
+         throw std::runtime_error("Failed to open tree cache for writing: " + temporaryPath);
+
+      const char padding[TREE_CACHE_ALIGNMENT] = {};
+
+      file.write(reinterpret_cast<const char*>(&header), sizeof(TreeCacheHeader));
+      file.write(padding, static_cast<std::streamsize>(header.nodeOffset - sizeof(TreeCacheHeader)));
+      file.write(reinterpret_cast<const char*>(tree.GPUReadyBuffer.data()), static_cast<std::streamsize>(sizeof(GPUNode) * header.nodeCount));
+      file.write(padding, static_cast<std::streamsize>(header.pointOffset - header.nodeOffset - sizeof(GPUNode) * header.nodeCount));
+      file.write(reinterpret_cast<const char*>(tree.GPUReadyPoints.data()), static_cast<std::streamsize>(sizeof(glm::vec4) * header.pointCount));
+
+      if (!file)
+         throw std::runtime_error("Failed to write tree cache: " + temporaryPath);
+   }
+
+   std::error_code error;
+   std::filesystem::rename(temporaryPath, cachePath, error);
+   if (error)
+   {
+      std::filesystem::remove(temporaryPath, error);
+      throw std::runtime_error("Failed to replace tree cache: " + cachePath);
+   }
+}
+
+bool TreeCache::Open(const std::string& cachePath, uint64_t sourceHash, uint64_t sourceSize, const BinaryTreeBuildSettings& settings)
+{
+   Close();
+
+   if (!m_file.Open(cachePath) || m_file.GetSize() < sizeof(TreeCacheHeader))
+   {
+      m_file.Close();
+      return false;
+   }
+
+   const TreeCacheHeader* header = reinterpret_cast<const TreeCacheHeader*>(m_file.GetData());
+
+   const bool isValid = std::memcmp(header->magic, TREE_CACHE_MAGIC, sizeof(TREE_CACHE_MAGIC)) == 0 &&
+                        header->version == TREE_CACHE_VERSION && header->headerSize == sizeof(TreeCacheHeader) &&
+                        header->gpuNodeSize == sizeof(GPUNode) &&
+                        header->maxPointsPerLeaf == MAX_POINTS_PER_LEAVES && header->maxTreeDepth == MAX_TREE_DEPTH &&
+                        header->nodeCount <= m_file.GetSize() / sizeof(GPUNode) &&
+                        header->pointCount <= m_file.GetSize() / sizeof(glm::vec4) &&
+                        header->nodeOffset <= m_file.GetSize() && header->pointOffset <= m_file.GetSize() &&
+                        header->nodeOffset % TREE_CACHE_ALIGNMENT == 0 && header->pointOffset % TREE_CACHE_ALIGNMENT == 0 &&
+                        header->nodeOffset + sizeof(GPUNode) * header->nodeCount <= header->pointOffset &&
+                        header->pointOffset + sizeof(glm::vec4) * header->pointCount <= m_file.GetSize();
+
+   if (!isValid || header->sourceHash != sourceHash || header->sourceSize != sourceSize || !IsSameTree(*header, settings))
+   {
+      m_file.Close();
+      return false;
+   }
+
+   m_header = header;
+   return true;
+}
+
+void TreeCache::Close()
+{
+   m_file.Close();
+   m_header = nullptr;
+}
+
+const GPUNode* TreeCache::GetNodes() const
+{
+   return reinterpret_cast<const GPUNode*>(m_file.GetData() + m_header->nodeOffset);
+}
+
+const glm::vec4* TreeCache::GetPoints() const
+{
+   return reinterpret_cast<const glm::vec4*>(m_file.GetData() + m_header->pointOffset);
+}
+#pragma endregion
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include "binaryTree.h"
+
+// Bump when the layout of the file or of GPUNode changes
+constexpr uint32_t TREE_CACHE_VERSION = 2;
+
+// Start of a .tree file. GPUReadyBuffer and GPUReadyPoints follow as they are, so that a mapped file
+// can go straight to the SSBO upload.
+struct TreeCacheHeader
+{
+   char magic[8];            // "PRMTREE\0"
+   uint32_t version;         // TREE_CACHE_VERSION
+   uint32_t headerSize;      // sizeof(TreeCacheHeader)
+
+   // Source .ply, the cache is stale as soon as one of them differs
+   uint64_t sourceHash;
+   uint64_t sourceSize;
+
+   // Build settings that change the tree (the thread settings never do)
+   int32_t builder;
+   int32_t sahBinCount;
+   float sphereRadius;
+
+   uint32_t gpuNodeSize;     // sizeof(GPUNode)
+
+   // Build constants of binaryTree.h, a tree built with other ones is stale as well
+   int32_t maxPointsPerLeaf; // MAX_POINTS_PER_LEAVES
+   int32_t maxTreeDepth;     // MAX_TREE_DEPTH
+
+   // Box of the whole cloud
+   float boundsMin[3];
+   float boundsMax[3];
+
+   uint64_t nodeCount;
+   uint64_t pointCount;
+
+   // In bytes from the start of the file, 16 bytes aligned
+   uint64_t nodeOffset;
+   uint64_t pointOffset;
+};
+
+// Read only mapping of a whole file
+class MappedFile
+{
+public:
+   MappedFile() = default;
+   ~MappedFile();
+
+   MappedFile(const MappedFile&) = delete;
+   MappedFile& operator=(const MappedFile&) = delete;
+
+   // False if the file is missing, empty or cannot be mapped
+   bool Open(const std::string& path);
+   void Close();
+
+   const uint8_t* GetData() const { return m_data; }
+   size_t GetSize() const { return m_size; }
+
+private:
+   const uint8_t* m_data = nullptr;
+   size_t m_size = 0;
+
+#ifdef _WIN32
+   void* m_file = nullptr;
+   void* m_mapping = nullptr;
+#endif
+};
+
+// Built trees saved next to their model, so that later loads skip the parsing and the build
+class TreeCache
+{
+public:
+   // model.ply -> model.tree
+   static std::string GetCachePath(const std::string& modelPath);
+
+   // Hash of the file content, read through a mapping. 0 and size 0 when the file cannot be opened.
+   static uint64_t HashFile(const std::string& path, uint64_t& size);
+
+   // Writes the tree to a temporary file then renames it, throws if it cannot be written
+   static void Write(const std::string& cachePath, uint64_t sourceHash, uint64_t sourceSize,
+                     const BinaryTreeBuildSettings& settings, const BinaryTree& tree);
+
+   // Maps cachePath, false if it is missing, broken, from another version or built from another source / settings
+   bool Open(const std::string& cachePath, uint64_t sourceHash, uint64_t sourceSize, const BinaryTreeBuildSettings& settings);
+   void Close();
+
+   // Only valid while open, they point in the mapping
+   const TreeCacheHeader& GetHeader() const { return *m_header; }
+   const GPUNode* GetNodes() const;
+   const glm::vec4* GetPoints() const;
+
+private:
+   MappedFile m_file;
+   const TreeCacheHeader* m_header = nullptr;
+};
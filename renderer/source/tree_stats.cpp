@@ -0,0 +1,157 @@
+#include "tree_stats.h"
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace
+{
+   glm::vec3 GrownMin(const GPUNode& node, float radius)
+   {
+      return glm::vec3(node.boxPos) - radius;
+   }
+
+   glm::vec3 GrownMax(const GPUNode& node, float radius)
+   {
+      return glm::vec3(node.boxPos) + glm::vec3(node.boxSize) + radius;
+   }
+
+   float Volume(glm::vec3 boxMin, glm::vec3 boxMax)
+   {
+      const glm::vec3 size = glm::max(boxMax - boxMin, glm::vec3(0));
+      return size.x * size.y * size.z;
+   }
+
+   float HalfArea(const GPUNode& node, float radius)
+   {
+      const glm::vec3 size = GrownMax(node, radius) - GrownMin(node, radius);
+      return size.x * size.y + size.y * size.z + size.z * size.x;
+   }
+
+   std::string Escape(const std::string& text)
+   {
+      std::string escaped;
+      for (const char c : text)
+      {
+         if (c == '"' || c == '\\')
+            escaped += '\\';
+         escaped += c;
+      }
+      return escaped;
+   }
+
+   template <typename T>
+   void WriteArray(std::ofstream& file, const T& values)
+   {
+      file << "[";
+      for (size_t i = 0; i < values.size(); i++)
+         file << (i > 0 ? ", " : "") << values[i];
+      file << "]";
+   }
+}
+
+TreeStats ComputeTreeStats(const GPUNode* nodes, size_t nodeCount, float sphereRadius)
+{
+   TreeStats stats;
+   if (nodeCount <= 1)
+      return stats;
+
+   size_t leafDepthSum = 0;
+   double sahCost = 0;
+   double overlapVolume = 0;
+   double childrenVolume = 0;
+
+   // (node, depth), the root is at depth 0. Children are checked before they are pushed.
+   std::vector<std::pair<int, int>> stack = { { 1, 0 } };
+   while (!stack.empty())
+   {
+      const auto [nodeIndex, depth] = stack.back();
+      stack.pop_back();
+
+      const GPUNode& node = nodes[nodeIndex];
+      stats.nodeCount++;
+      stats.maxDepth = std::max(stats.maxDepth, depth);
+
+      const int pointCount = node.children.w;
+      const bool isInternal = pointCount == 0 && (node.children.x > 0 || node.children.y > 0);
+      if (isInternal)
+      {
+         sahCost += HalfArea(node, sphereRadius) * SAH_NODE_COST;
+
+         for (const int child : { node.children.x, node.children.y })
+         {
+            if (child <= 0 || static_cast<size_t>(child) >= nodeCount)
+               throw std::runtime_error("Tree statistics: node link out of the array");
+         }
+
+         const GPUNode& left = nodes[node.children.x];
+         const GPUNode& right = nodes[node.children.y];
+         overlapVolume += Volume(glm::max(GrownMin(left, sphereRadius), GrownMin(right, sphereRadius)),
+                                 glm::min(GrownMax(left, sphereRadius), GrownMax(right, sphereRadius)));
+         childrenVolume += Volume(GrownMin(left, sphereRadius), GrownMax(left, sphereRadius)) +
+                           Volume(GrownMin(right, sphereRadius), GrownMax(right, sphereRadius));
+
+         stack.push_back({ node.children.y, depth + 1 });
+         stack.push_back({ node.children.x, depth + 1 });
+         continue;
+      }
+
+      stats.leafCount++;
+      stats.pointCount += pointCount;
+      leafDepthSum += depth;
+      if (pointCount == 0)
+         stats.emptyLeafCount++;
+
+      if (stats.leavesPerDepth.size() <= static_cast<size_t>(depth))
+         stats.leavesPerDepth.resize(depth + 1, 0);
+      stats.leavesPerDepth[depth]++;
+      stats.leavesPerFill[std::min(pointCount, MAX_POINTS_PER_LEAVES)]++;
+
+      sahCost += HalfArea(node, sphereRadius) * pointCount * SAH_POINT_COST;
+   }
+
+   const float rootArea = std::max(HalfArea(nodes[1], sphereRadius), std::numeric_limits<float>::min());
+   stats.sahCost = static_cast<float>(sahCost / rootArea);
+   stats.siblingOverlap = childrenVolume > 0 ? static_cast<float>(overlapVolume / childrenVolume) : 0.f;
+   stats.averageLeafDepth = static_cast<float>(leafDepthSum) / static_cast<float>(stats.leafCount);
+   stats.averageLeafFill = static_cast<float>(stats.pointCount) / static_cast<float>(stats.leafCount * MAX_POINTS_PER_LEAVES);
+   return stats;
+}
+
+void WriteTreeStats(const TreeStats& stats, const std::string& name, const std::string& path)
+{
+   std::ofstream file(path);
+   if (!file)
+      throw std::runtime_error("Could not open " + path);
+
+   file << "{\n";
+   file << "  \"model\": \"" << Escape(name) << "\",\n";
+   file << "  \"nodeCount\": " << stats.nodeCount << ",\n";
+   file << "  \"leafCount\": " << stats.leafCount << ",\n";
+   file << "  \"emptyLeafCount\": " << stats.emptyLeafCount << ",\n";
+   file << "  \"pointCount\": " << stats.pointCount << ",\n";
+   file << "  \"maxDepth\": " << stats.maxDepth << ",\n";
+   file << "  \"averageLeafDepth\": " << stats.averageLeafDepth << ",\n";
+   file << "  \"leavesPerDepth\": ";
+   WriteArray(file, stats.leavesPerDepth);
+   file << ",\n  \"leavesPerFill\": ";
+   WriteArray(file, stats.leavesPerFill);
+   file << ",\n";
+   file << "  \"averageLeafFill\": " << stats.averageLeafFill << ",\n";
+   file << "  \"sahCost\": " << stats.sahCost << ",\n";
+   file << "  \"siblingOverlap\": " << stats.siblingOverlap << ",\n";
+   file << "  \"gpuBytes\": " << stats.gpuBytes << ",\n";
+   file << "  \"cpuBytes\": " << stats.cpuBytes << ",\n";
+   file << "  \"buildPhases\": [";
+   for (size_t i = 0; i < stats.buildPhases.size(); i++)
+   {
+      file << (i > 0 ? ", " : "") << "{ \"name\": \"" << Escape(stats.buildPhases[i].name)
+           << "\", \"milliseconds\": " << stats.buildPhases[i].milliseconds << " }";
+   }
+   file << "]\n}\n";
+
+   if (!file)
+      throw std::runtime_error("Could not write " + path);
+}
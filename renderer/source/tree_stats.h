@@ -0,0 +1,41 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <vector>
+
+#include "binaryTree.h"
+
+// Shape and cost of a built tree, read from its GPU nodes so a tree loaded from the cache gets the same report
+struct TreeStats
+{
+   size_t nodeCount = 0;      // reachable from the root
+   size_t leafCount = 0;
+   size_t emptyLeafCount = 0; // no point and no child
+   size_t pointCount = 0;     // points under the leaves
+
+   int maxDepth = 0;
+   float averageLeafDepth = 0;
+   std::vector<size_t> leavesPerDepth;
+
+   std::array<size_t, MAX_POINTS_PER_LEAVES + 1> leavesPerFill = {}; // leaves holding i points, the last one holds the fuller ones
+   float averageLeafFill = 0;                                         // points per leaf over MAX_POINTS_PER_LEAVES
+
+   // Expected traversal cost (SAH_NODE_COST, SAH_POINT_COST) relative to the root box, boxes grown by the sphere radius
+   float sahCost = 0;
+
+   // Volume shared by the two children of every internal node over the volume of all those children,
+   // boxes grown by the sphere radius. 0 = disjoint siblings.
+   float siblingOverlap = 0;
+
+   size_t gpuBytes = 0;
+   size_t cpuBytes = 0;
+
+   std::vector<BuildPhase> buildPhases;
+};
+
+// Walks the binary GPU nodes from the root (node 1). Throws std::runtime_error on a link out of the array.
+TreeStats ComputeTreeStats(const GPUNode* nodes, size_t nodeCount, float sphereRadius);
+
+// JSON report of stats, name is the model. Throws std::runtime_error when the file can not be written.
+void WriteTreeStats(const TreeStats& stats, const std::string& name, const std::string& path);
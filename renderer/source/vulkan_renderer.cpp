@@ -1,5 +1,7 @@
 #include "vulkan_renderer.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
 #include <set>
 #include <random>
@@ -17,7 +19,10 @@ void VulkanRenderer::Run()
 {
     InitWindow();
     m_modelPaths = LoadPLYFilePaths("point_clouds/");
+#if !COMPUTE
+    // The compute path parses a model only when it has no valid tree cache
     m_modelCache.LoadAllModelsInCache(m_modelPaths);
+#endif
 
     //LoadGeneratedPoint();
 
@@ -142,10 +147,15 @@ void VulkanRenderer::InitVulkan()
     CreateUniformBuffers();
     CreateDescriptorPool();
     CreateStorageImage();
+    CreateTileBuffer();
+    CreateTemporalBuffers();
+    CreateConeBuffer();
     CreateDescriptorSets();
     CreateComputeDescriptorSets();
+    CreateRefitPipeline();
     CreateCommandBuffers();
     CreateComputeCommandBuffers();
+    CreateComputeQueryPool();
 #else
     CreateTextureSampler();
     CreateDescriptorSetLayout();
@@ -205,7 +215,14 @@ void VulkanRenderer::Cleanup()
 #if COMPUTE
     // Compute-specific pipelines
     vkDestroyPipeline(m_device, m_computePipeline, nullptr);
+    vkDestroyPipeline(m_device, m_tileBinningPipeline, nullptr);
+    vkDestroyPipeline(m_device, m_reprojectionPipeline, nullptr);
+    vkDestroyPipeline(m_device, m_conePrepassPipeline, nullptr);
     vkDestroyPipelineLayout(m_device, m_computePipelineLayout, nullptr);
+    vkDestroyPipeline(m_device, m_refitPipeline, nullptr);
+    vkDestroyPipelineLayout(m_device, m_refitPipelineLayout, nullptr);
+    if (m_computeQueryPool != VK_NULL_HANDLE)
+        vkDestroyQueryPool(m_device, m_computeQueryPool, nullptr);
 #endif
 
     vkDestroyPipeline(m_device, m_graphicsComputePipeline, nullptr);
@@ -221,6 +238,10 @@ void VulkanRenderer::Cleanup()
         vkDestroyBuffer(m_device, m_ssboBuffer, nullptr);
     if (m_ssboMemory != VK_NULL_HANDLE)
         vkFreeMemory(m_device, m_ssboMemory, nullptr);
+    if (m_pointSSBOBuffer != VK_NULL_HANDLE)
+        vkDestroyBuffer(m_device, m_pointSSBOBuffer, nullptr);
+    if (m_pointSSBOMemory != VK_NULL_HANDLE)
+        vkFreeMemory(m_device, m_pointSSBOMemory, nullptr);
 
     for (size_t j = 0; j < NUMBER_OF_UBO; ++j)
     {
@@ -243,6 +264,8 @@ void VulkanRenderer::Cleanup()
 #if COMPUTE
     if (m_computeDescriptorSetLayout != VK_NULL_HANDLE)
         vkDestroyDescriptorSetLayout(m_device, m_computeDescriptorSetLayout, nullptr);
+    if (m_refitDescriptorSetLayout != VK_NULL_HANDLE)
+        vkDestroyDescriptorSetLayout(m_device, m_refitDescriptorSetLayout, nullptr);
 #endif
 
     // --- Shared Resources ---
@@ -284,12 +307,10 @@ void VulkanRenderer::Cleanup()
 
     // --- Storage Image (used for compute rendering output) ---
 #if COMPUTE
-    if (m_storageImageView != VK_NULL_HANDLE)
-        vkDestroyImageView(m_device, m_storageImageView, nullptr);
-    if (m_storageImage != VK_NULL_HANDLE)
-        vkDestroyImage(m_device, m_storageImage, nullptr);
-    if (m_storageImageMemory != VK_NULL_HANDLE)
-        vkFreeMemory(m_device, m_storageImageMemory, nullptr);
+    DestroyStorageImage();
+    DestroyTileBuffer();
+    DestroyTemporalBuffers();
+    DestroyConeBuffer();
 #endif
 
     // --- Core Vulkan Cleanup ---
@@ -325,6 +346,10 @@ void VulkanRenderer::RecreateSwapChain()
     CreateImageViews();
     CreateFramebuffers();
 
+#if COMPUTE
+    RecreateStorageImage();
+#endif
+
     ImGui_ImplVulkan_SetMinImageCount(m_minImageCount);
 }
 
@@ -430,6 +455,95 @@ void VulkanRenderer::MainImGui()
             }
         }
         ImGui::Text("Number of points: %zu", m_vertexNb);
+
+        const char* treeBuilders[TREE_BUILDER_COUNT] = { "Median split", "LBVH (Morton)", "SAH (binned)" };
+        if (ImGui::Combo("Tree builder", &m_treeBuildSettings.builder, treeBuilders, TREE_BUILDER_COUNT) && !m_modelPaths.empty())
+            ReloadModel(m_modelPaths[m_currentModelIndex]);
+        if (m_treeFromCache)
+            ImGui::Text("Tree loaded from cache: %.1f ms", m_treeBuildTime);
+        else
+            ImGui::Text("Tree build: %.1f ms", m_treeBuildTime);
+
+        // The shader reads one node format only: rebuild it, then upload the tree again
+        const char* nodeFormats[NODE_FORMAT_COUNT] = { "Binary", "Binary compact (16 bits)", "4-wide", "8-wide" };
+        if (ImGui::Combo("Node format", &m_nodeFormat, nodeFormats, NODE_FORMAT_COUNT) && !m_modelPaths.empty())
+        {
+            vkDeviceWaitIdle(m_device);
+            CreateComputePipeline();
+            ReloadModel(m_modelPaths[m_currentModelIndex]);
+        }
+        ImGui::Text("Tree GPU memory: %.1f MB", static_cast<float>(m_treeGPUSize) / (1024.f * 1024.f));
+
+        // The other formats keep their own order
+        if (m_nodeFormat == NODE_FORMAT_BINARY)
+        {
+            const char* nodeLayouts[NODE_LAYOUT_COUNT] = { "Depth-first", "Treelets" };
+            bool relayout = ImGui::Combo("Node layout", &m_nodeLayout, nodeLayouts, NODE_LAYOUT_COUNT);
+            if (m_nodeLayout == NODE_LAYOUT_TREELET)
+            {
+                ImGui::SliderInt("Treelet size", &m_treeletSize, 3, 63);
+                relayout |= ImGui::IsItemDeactivatedAfterEdit();
+            }
+            if (relayout && !m_modelPaths.empty())
+                ReloadModel(m_modelPaths[m_currentModelIndex]);
+
+            ImGui::Text("Node cache lines per ray: %.1f (depth-first: %.1f)", m_nodeCacheLines, m_depthFirstCacheLines);
+        }
+
+        // A cached tree is built the first time one of these changes it
+        ImGui::SeparatorText("Live updates");
+        ImGui::SliderInt("Points per batch", &m_updateBatchSize, 1, 100000, "%d", ImGuiSliderFlags_Logarithmic);
+        if (ImGui::Button("Insert"))
+            UpdateTree(m_updateBatchSize, 0);
+        ImGui::SameLine();
+        if (ImGui::Button("Remove"))
+            UpdateTree(0, m_updateBatchSize);
+        ImGui::SameLine();
+        ImGui::Checkbox("Stream", &m_streamUpdates);
+        if (m_streamUpdates)
+            UpdateTree(m_updateBatchSize, m_updateBatchSize);
+
+        ImGui::Text("Tree points: %zu", m_treeFromCache ? m_vertexNb : m_binaryTree.GetPointCount());
+        ImGui::Text("Update: %.2f ms, uploaded %.1f KB", m_treeUpdateTime, static_cast<float>(m_treeUploadBytes) / 1024.f);
+
+        // The GPU refit needs the node SSBO in the arena order, the other formats go through the CPU
+        ImGui::SeparatorText("Deformation");
+        ImGui::Checkbox("Deform points", &m_deformPoints);
+        ImGui::SliderFloat("Amplitude", &m_deformAmplitude, 0.f, 0.5f);
+        ImGui::Checkbox("Refit on the GPU", &m_refitOnGPU);
+        ImGui::Checkbox("Rebuild when worth it", &m_autoRebuild);
+        if (ImGui::Button("Rebuild now"))
+            RebuildDeformedTree();
+        if (m_deformPoints)
+            DeformPoints();
+
+        ImGui::Text("Refit: %.2f ms", m_refitTime);
+        ImGui::Text("Refit quality: %.2f (rebuild past %.2f)", m_refitQuality, BinaryTree::REFIT_REBUILD_RATIO);
+
+        ImGui::SeparatorText("Tree statistics");
+        ImGui::Text("Nodes: %zu, leaves: %zu (%zu empty)", m_treeStats.nodeCount, m_treeStats.leafCount, m_treeStats.emptyLeafCount);
+        ImGui::Text("Depth: %d max, %.1f average leaf", m_treeStats.maxDepth, m_treeStats.averageLeafDepth);
+        ImGui::Text("Leaf fill: %.0f%% of %d points", m_treeStats.averageLeafFill * 100.f, MAX_POINTS_PER_LEAVES);
+        ImGui::Text("SAH cost: %.1f, sibling overlap: %.2f%%", m_treeStats.sahCost, m_treeStats.siblingOverlap * 100.f);
+        ImGui::Text("Memory: GPU %.1f MB, CPU %.1f MB", static_cast<float>(m_treeStats.gpuBytes) / (1024.f * 1024.f),
+                    static_cast<float>(m_treeStats.cpuBytes) / (1024.f * 1024.f));
+        for (const BuildPhase& phase : m_treeStats.buildPhases)
+            ImGui::BulletText("%s: %.2f ms", phase.name, phase.milliseconds);
+
+        std::vector<float> leavesPerDepth(m_treeStats.leavesPerDepth.begin(), m_treeStats.leavesPerDepth.end());
+        ImGui::PlotHistogram("Leaves per depth", leavesPerDepth.data(), static_cast<int>(leavesPerDepth.size()), 0, nullptr,
+                             0.f, FLT_MAX, ImVec2(0, 60));
+        std::vector<float> leavesPerFill(m_treeStats.leavesPerFill.begin(), m_treeStats.leavesPerFill.end());
+        ImGui::PlotHistogram("Leaves per fill", leavesPerFill.data(), static_cast<int>(leavesPerFill.size()), 0, nullptr,
+                             0.f, FLT_MAX, ImVec2(0, 60));
+
+        // A cached tree is not kept once uploaded, its statistics stay the ones of the load
+        if (!m_treeFromCache && ImGui::Button("Refresh"))
+            UpdateTreeStats(m_binaryTree.GPUReadyBuffer.data(), m_binaryTree.GPUReadyBuffer.size());
+        if (!m_treeFromCache)
+            ImGui::SameLine();
+        if (ImGui::Button("Write report"))
+            WriteTreeStatsReport();
 #else
         ImGui::Text("Number of points: %d", 6);
 #endif
@@ -451,6 +565,22 @@ void VulkanRenderer::MainImGui()
 #if COMPUTE
         ImGui::Checkbox("boxDebug", &m_boxDebug);
         ImGui::Checkbox("randomColor", &m_randomColor);
+
+        const char* traversalModes[TRAVERSAL_MODE_COUNT] = { "Ray (every step)", "Ray (cached leaves)", "Nearest (distance pruned)", "Tile leaves (binned)" };
+        ImGui::Combo("Traversal", &m_traversalMode, traversalModes, TRAVERSAL_MODE_COUNT);
+
+        // The compute pass renders a corner of the storage image, scaled up to the window
+        ImGui::Checkbox("Dynamic resolution", &m_dynamicResolution);
+        if (m_dynamicResolution)
+            ImGui::SliderFloat("Target frame time (ms)", &m_targetFrameTime, 4.f, 50.f);
+        else
+            ImGui::SliderFloat("Render scale", &m_renderScale, MIN_RENDER_SCALE, MAX_RENDER_SCALE);
+
+        const VkExtent2D renderExtent = GetRenderExtent();
+        ImGui::Text("Render: %ux%u (x%.2f), compute pass %.2f ms", renderExtent.width, renderExtent.height, m_renderScale, m_computeTime);
+
+        ImGui::Checkbox("Temporal reprojection", &m_temporalReprojection);
+        ImGui::Checkbox("Cone prepass", &m_conePrepass);
 #endif
 
 
@@ -1444,9 +1574,18 @@ void VulkanRenderer::RecordCommandBuffer(VkCommandBuffer commandBuffer, uint32_t
 void VulkanRenderer::UpdateUniformBuffer(uint32_t currentImage) const
 {
     UniformBufferObject ubo{};
-    ubo.settings1 = glm::vec4(m_lighting, m_boxDebug, m_randomColor, 0);
+    ubo.settings1 = glm::vec4(m_lighting, m_boxDebug, m_randomColor, m_traversalMode);
     ubo.settings2 = glm::vec4(m_sphereRadius, static_cast<float>(glfwGetTime()), m_blendingFactor, m_far);
+#if COMPUTE
+    const VkExtent2D renderExtent = GetRenderExtent();
+    ubo.settings3 = glm::vec4(m_reflectivity, static_cast<float>(renderExtent.width), static_cast<float>(renderExtent.height), 0.0f);
+    ubo.previousCameraPos = glm::vec4(m_previousCameraPos, 0.0f);
+    ubo.previousCameraFront = glm::vec4(m_previousCameraFront, 0.0f);
+    ubo.temporal = glm::vec4(m_temporalReprojection, m_temporalUsable, static_cast<float>(m_temporalHalf), 0.0f);
+    ubo.conePrepass = glm::vec4(m_conePrepass, 0.0f, 0.0f, 0.0f);
+#else
     ubo.settings3 = glm::vec4(m_reflectivity, 0.0f, 0.0f, 0.0f);
+#endif
     ubo.lightingDir = glm::vec4(m_lightingDir, 0.0f);
     ubo.objectColor = glm::vec4(m_objectColor, 0.0f);
     ubo.cameraPos = glm::vec4(m_cameraPos, 0.0f);
@@ -1724,6 +1863,8 @@ void VulkanRenderer::BeginFrame()
     vkWaitForFences(m_device, 1, &m_computeInFlightFences[m_currentFrame], VK_TRUE, UINT64_MAX);
     vkResetFences(m_device, 1, &m_computeInFlightFences[m_currentFrame]);
     vkResetCommandBuffer(m_computeCommandBuffers[m_currentFrame], /*VkCommandBufferResetFlagBits*/ 0);
+
+    UpdateDynamicResolution();
 #endif
 
     vkWaitForFences(m_device, 1, &m_inFlightFences[m_currentFrame], VK_TRUE, UINT64_MAX);
@@ -1763,6 +1904,9 @@ void VulkanRenderer::BeginFrame()
 void VulkanRenderer::DrawFrame()
 {
     ZoneScopedN("DrawFrame");
+#if COMPUTE
+    BeginTemporalFrame();
+#endif
     UpdateUniformBuffer(m_currentFrame);
 
 #if COMPUTE
@@ -1779,6 +1923,9 @@ void VulkanRenderer::DrawFrame()
     if (vkQueueSubmit(m_computeQueue, 1, &computeSubmitInfo, m_computeInFlightFences[m_currentFrame]) != VK_SUCCESS)
         throw std::runtime_error("Failed to submit compute command buffer!");
 
+    m_computeTimestampsWritten = m_computeQueryPool != VK_NULL_HANDLE;
+    EndTemporalFrame();
+
     // --- 2. Transition image layout: GENERAL → SHADER_READ_ONLY_OPTIMAL
     ComputeTransitionImageLayout(
         m_storageImage,
@@ -1875,6 +2022,48 @@ void VulkanRenderer::EndFrame()
 // Models & Binary tree
 void VulkanRenderer::LoadModel(const std::string& path)
 {
+#if COMPUTE
+    // The SAH builder weighs boxes as the shader sees them, grown by the sphere radius
+    m_treeBuildSettings.sphereRadius = m_sphereRadius;
+
+    m_treeLive = false;
+    m_streamUpdates = false;
+    m_insertedPoints.clear();
+    m_deformPoints = false;
+    m_restPoints.clear();
+    m_refitQuality = 1.f;
+    m_cpuTreeBehind = false;
+
+    // A tree cached for this exact file and these settings is uploaded straight from the mapped file:
+    // no parsing, no build. The model vertex / index buffers are not drawn by the compute path.
+    std::chrono::high_resolution_clock::time_point loadStart = std::chrono::high_resolution_clock::now();
+
+    uint64_t sourceSize = 0;
+    const uint64_t sourceHash = TreeCache::HashFile(path, sourceSize);
+    const std::string cachePath = TreeCache::GetCachePath(path);
+
+    TreeCache treeCache;
+    if (!m_skipTreeCache && treeCache.Open(cachePath, sourceHash, sourceSize, m_treeBuildSettings))
+    {
+        const TreeCacheHeader& header = treeCache.GetHeader();
+
+        m_vertices.clear();
+        m_indices.clear();
+        m_vertexNb = header.pointCount;
+        m_binaryTree = BinaryTree();
+
+        CreateSSBOBuffer(treeCache.GetNodes(), header.nodeCount, treeCache.GetPoints(), header.pointCount);
+
+        m_treeBuildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - loadStart).count();
+        m_treeFromCache = true;
+
+        m_treeStatsModel = path;
+        UpdateTreeStats(treeCache.GetNodes(), header.nodeCount);
+        WriteTreeStatsReport();
+        return;
+    }
+#endif
+
     if (!m_modelCache.LoadModelInCache(path))
     {
         std::cerr << "Error loading model from cache: " << path << std::endl;
@@ -1902,9 +2091,27 @@ void VulkanRenderer::LoadModel(const std::string& path)
         cloudPoints.push_back(m_vertices[i].pos);
     }
 
-    m_binaryTree = BinaryTree(cloudPoints);
+    std::chrono::high_resolution_clock::time_point buildStart = std::chrono::high_resolution_clock::now();
+    m_binaryTree = BinaryTree(cloudPoints, m_treeBuildSettings);
+    m_treeBuildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+    m_treeFromCache = false;
 
-    CreateSSBOBuffer();
+    // A cache that cannot be written only costs the next load a rebuild
+    try
+    {
+        TreeCache::Write(cachePath, sourceHash, sourceSize, m_treeBuildSettings, m_binaryTree);
+    }
+    catch (const std::exception& exception)
+    {
+        std::cerr << exception.what() << std::endl;
+    }
+
+    CreateSSBOBuffer(m_binaryTree.GPUReadyBuffer.data(), m_binaryTree.GPUReadyBuffer.size(),
+                     m_binaryTree.GPUReadyPoints.data(), m_binaryTree.GPUReadyPoints.size());
+
+    m_treeStatsModel = path;
+    UpdateTreeStats(m_binaryTree.GPUReadyBuffer.data(), m_binaryTree.GPUReadyBuffer.size());
+    WriteTreeStatsReport();
 #endif
 
     CreateVertexBuffer();
@@ -1917,6 +2124,10 @@ void VulkanRenderer::ReloadModel(const std::string& path)
 
     DestroyModelResources();
     LoadModel(path);
+
+#if COMPUTE
+    UpdateComputeSSBODescriptors();
+#endif
 }
 
 void VulkanRenderer::DestroyModelResources()
@@ -1945,6 +2156,16 @@ void VulkanRenderer::DestroyModelResources()
         m_quadIndexBufferMemory = VK_NULL_HANDLE;
     }
 
+    DestroySSBOBuffers();
+}
+
+void VulkanRenderer::DestroySSBOBuffers()
+{
+#if COMPUTE
+    // Bound to these buffers
+    DestroyRefitBuffers();
+#endif
+
     if (m_ssboBuffer != VK_NULL_HANDLE)
     {
         vkDestroyBuffer(m_device, m_ssboBuffer, nullptr);
@@ -1952,6 +2173,14 @@ void VulkanRenderer::DestroyModelResources()
         m_ssboBuffer = VK_NULL_HANDLE;
         m_ssboMemory = VK_NULL_HANDLE;
     }
+
+    if (m_pointSSBOBuffer != VK_NULL_HANDLE)
+    {
+        vkDestroyBuffer(m_device, m_pointSSBOBuffer, nullptr);
+        vkFreeMemory(m_device, m_pointSSBOMemory, nullptr);
+        m_pointSSBOBuffer = VK_NULL_HANDLE;
+        m_pointSSBOMemory = VK_NULL_HANDLE;
+    }
 }
 
 
@@ -2011,9 +2240,12 @@ void VulkanRenderer::CreateStorageImage()
     VkImageCreateInfo imageInfo{};
     imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
     imageInfo.imageType = VK_IMAGE_TYPE_2D;
+    m_storageImageExtent.width = static_cast<uint32_t>(std::ceil(static_cast<float>(m_swapChainExtent.width) * MAX_RENDER_SCALE));
+    m_storageImageExtent.height = static_cast<uint32_t>(std::ceil(static_cast<float>(m_swapChainExtent.height) * MAX_RENDER_SCALE));
+
     imageInfo.format = VK_FORMAT_R32G32B32A32_SFLOAT;
-    imageInfo.extent.width = m_swapChainExtent.width * 2;
-    imageInfo.extent.height = m_swapChainExtent.height * 2;
+    imageInfo.extent.width = m_storageImageExtent.width;
+    imageInfo.extent.height = m_storageImageExtent.height;
     imageInfo.extent.depth = 1;
     imageInfo.mipLevels = 1;
     imageInfo.arrayLayers = 1;
@@ -2068,6 +2300,294 @@ void VulkanRenderer::CreateStorageImage()
     m_storageImageLayout = VK_IMAGE_LAYOUT_GENERAL;
 }
 
+// Sized from the storage image, TILE_SIZE pixels per side: a counter per tile then its MAX_TILE_LEAVES entries (leaf, depth)
+void VulkanRenderer::CreateTileBuffer()
+{
+    const uint32_t tilesX = (m_storageImageExtent.width + TILE_SIZE - 1) / TILE_SIZE;
+    const uint32_t tilesY = (m_storageImageExtent.height + TILE_SIZE - 1) / TILE_SIZE;
+    m_tileCount = tilesX * tilesY;
+
+    const VkDeviceSize bufferSize = sizeof(uint32_t) * m_tileCount * (1 + 2 * MAX_TILE_LEAVES);
+
+    CreateBuffer(bufferSize,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        m_tileBuffer, m_tileBufferMemory);
+}
+
+void VulkanRenderer::DestroyStorageImage()
+{
+    if (m_storageImageView != VK_NULL_HANDLE)
+        vkDestroyImageView(m_device, m_storageImageView, nullptr);
+    if (m_storageImage != VK_NULL_HANDLE)
+        vkDestroyImage(m_device, m_storageImage, nullptr);
+    if (m_storageImageMemory != VK_NULL_HANDLE)
+        vkFreeMemory(m_device, m_storageImageMemory, nullptr);
+
+    m_storageImageView = VK_NULL_HANDLE;
+    m_storageImage = VK_NULL_HANDLE;
+    m_storageImageMemory = VK_NULL_HANDLE;
+    m_storageImageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+}
+
+void VulkanRenderer::DestroyTileBuffer()
+{
+    if (m_tileBuffer != VK_NULL_HANDLE)
+        vkDestroyBuffer(m_device, m_tileBuffer, nullptr);
+    if (m_tileBufferMemory != VK_NULL_HANDLE)
+        vkFreeMemory(m_device, m_tileBufferMemory, nullptr);
+
+    m_tileBuffer = VK_NULL_HANDLE;
+    m_tileBufferMemory = VK_NULL_HANDLE;
+    m_tileCount = 0;
+}
+
+// A float per pixel of the storage image: twice for the distances, once for the start bounds
+void VulkanRenderer::CreateTemporalBuffers()
+{
+    const VkDeviceSize pixelCount = static_cast<VkDeviceSize>(m_storageImageExtent.width) * m_storageImageExtent.height;
+
+    CreateBuffer(2 * pixelCount * sizeof(float),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        m_temporalBuffer, m_temporalBufferMemory);
+
+    CreateBuffer(pixelCount * sizeof(uint32_t),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        m_startBoundBuffer, m_startBoundBufferMemory);
+
+    m_temporalHistoryValid = false;
+}
+
+void VulkanRenderer::DestroyTemporalBuffers()
+{
+    if (m_temporalBuffer != VK_NULL_HANDLE)
+        vkDestroyBuffer(m_device, m_temporalBuffer, nullptr);
+    if (m_temporalBufferMemory != VK_NULL_HANDLE)
+        vkFreeMemory(m_device, m_temporalBufferMemory, nullptr);
+    if (m_startBoundBuffer != VK_NULL_HANDLE)
+        vkDestroyBuffer(m_device, m_startBoundBuffer, nullptr);
+    if (m_startBoundBufferMemory != VK_NULL_HANDLE)
+        vkFreeMemory(m_device, m_startBoundBufferMemory, nullptr);
+
+    m_temporalBuffer = VK_NULL_HANDLE;
+    m_temporalBufferMemory = VK_NULL_HANDLE;
+    m_startBoundBuffer = VK_NULL_HANDLE;
+    m_startBoundBufferMemory = VK_NULL_HANDLE;
+}
+
+// A float per CONE_BLOCK_SIZE block of the storage image
+void VulkanRenderer::CreateConeBuffer()
+{
+    const VkDeviceSize blocksX = (m_storageImageExtent.width + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE;
+    const VkDeviceSize blocksY = (m_storageImageExtent.height + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE;
+
+    CreateBuffer(blocksX * blocksY * sizeof(float),
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        m_coneBuffer, m_coneBufferMemory);
+}
+
+void VulkanRenderer::DestroyConeBuffer()
+{
+    if (m_coneBuffer != VK_NULL_HANDLE)
+        vkDestroyBuffer(m_device, m_coneBuffer, nullptr);
+    if (m_coneBufferMemory != VK_NULL_HANDLE)
+        vkFreeMemory(m_device, m_coneBufferMemory, nullptr);
+
+    m_coneBuffer = VK_NULL_HANDLE;
+    m_coneBufferMemory = VK_NULL_HANDLE;
+}
+
+// The rays of this frame can start from the last one when it wrote its distances at the same render size,
+// with the same surfaces: same tree (every upload drops the history) and same SDF settings
+void VulkanRenderer::BeginTemporalFrame()
+{
+    const VkExtent2D renderExtent = GetRenderExtent();
+    const glm::vec3 surfaceSettings(m_sphereRadius, m_blendingFactor, m_boxDebug ? 1.f : 0.f);
+
+    m_temporalUsable = m_temporalReprojection && m_temporalHistoryValid &&
+                       renderExtent.width == m_previousRenderExtent.width && renderExtent.height == m_previousRenderExtent.height &&
+                       surfaceSettings == m_previousSurfaceSettings;
+
+    m_previousRenderExtent = renderExtent;
+    m_previousSurfaceSettings = surfaceSettings;
+}
+
+// Once the compute pass is submitted: its distances and camera are the history of the next frame
+void VulkanRenderer::EndTemporalFrame()
+{
+    m_temporalHistoryValid = m_temporalReprojection;
+    m_temporalHalf = 1 - m_temporalHalf;
+    m_previousCameraPos = m_cameraPos;
+    m_previousCameraFront = m_cameraFront;
+}
+
+// Follows the swapchain size, the render scale only changes the part of the image that is written. The device is idle.
+void VulkanRenderer::RecreateStorageImage()
+{
+    DestroyConeBuffer();
+    DestroyTemporalBuffers();
+    DestroyTileBuffer();
+    DestroyStorageImage();
+
+    CreateStorageImage();
+    CreateTileBuffer();
+    CreateTemporalBuffers();
+    CreateConeBuffer();
+    UpdateStorageImageDescriptors();
+}
+
+// Storage image (compute binding 1, sampled by the graphics binding 1) and the buffers sized from it:
+// tile buffer (compute binding 4), temporal buffers (compute bindings 5 and 6), cone buffer (compute binding 7)
+void VulkanRenderer::UpdateStorageImageDescriptors()
+{
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+    {
+        VkDescriptorImageInfo storageImageInfo{};
+        storageImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        storageImageInfo.imageView = m_storageImageView;
+        storageImageInfo.sampler = VK_NULL_HANDLE;
+
+        VkDescriptorImageInfo sampledImageInfo{};
+        sampledImageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        sampledImageInfo.imageView = m_storageImageView;
+        sampledImageInfo.sampler = m_textureSampler;
+
+        VkDescriptorBufferInfo tileBufferInfo{};
+        tileBufferInfo.buffer = m_tileBuffer;
+        tileBufferInfo.offset = 0;
+        tileBufferInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo temporalBufferInfo{};
+        temporalBufferInfo.buffer = m_temporalBuffer;
+        temporalBufferInfo.offset = 0;
+        temporalBufferInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo startBoundBufferInfo{};
+        startBoundBufferInfo.buffer = m_startBoundBuffer;
+        startBoundBufferInfo.offset = 0;
+        startBoundBufferInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo coneBufferInfo{};
+        coneBufferInfo.buffer = m_coneBuffer;
+        coneBufferInfo.offset = 0;
+        coneBufferInfo.range = VK_WHOLE_SIZE;
+
+        std::array<VkWriteDescriptorSet, 6> descriptorWrites{};
+
+        // Storage image
+        descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[0].dstSet = m_computeDescriptorSets[i];
+        descriptorWrites[0].dstBinding = 1;
+        descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptorWrites[0].descriptorCount = 1;
+        descriptorWrites[0].pImageInfo = &storageImageInfo;
+
+        // Tile leaf lists
+        descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[1].dstSet = m_computeDescriptorSets[i];
+        descriptorWrites[1].dstBinding = 4;
+        descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[1].descriptorCount = 1;
+        descriptorWrites[1].pBufferInfo = &tileBufferInfo;
+
+        // Same image sampled by compute_Raymarching.frag
+        descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[2].dstSet = m_descriptorSets[i];
+        descriptorWrites[2].dstBinding = 1;
+        descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        descriptorWrites[2].descriptorCount = 1;
+        descriptorWrites[2].pImageInfo = &sampledImageInfo;
+
+        // Hit distances
+        descriptorWrites[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[3].dstSet = m_computeDescriptorSets[i];
+        descriptorWrites[3].dstBinding = 5;
+        descriptorWrites[3].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[3].descriptorCount = 1;
+        descriptorWrites[3].pBufferInfo = &temporalBufferInfo;
+
+        // Start bounds
+        descriptorWrites[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[4].dstSet = m_computeDescriptorSets[i];
+        descriptorWrites[4].dstBinding = 6;
+        descriptorWrites[4].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[4].descriptorCount = 1;
+        descriptorWrites[4].pBufferInfo = &startBoundBufferInfo;
+
+        // Cone start distances
+        descriptorWrites[5].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[5].dstSet = m_computeDescriptorSets[i];
+        descriptorWrites[5].dstBinding = 7;
+        descriptorWrites[5].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[5].descriptorCount = 1;
+        descriptorWrites[5].pBufferInfo = &coneBufferInfo;
+
+        vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+    }
+}
+
+// Swapchain size times the render scale, never more than the storage image
+VkExtent2D VulkanRenderer::GetRenderExtent() const
+{
+    const float scale = std::clamp(m_renderScale, MIN_RENDER_SCALE, MAX_RENDER_SCALE);
+
+    VkExtent2D extent;
+    extent.width = std::clamp(static_cast<uint32_t>(static_cast<float>(m_swapChainExtent.width) * scale), 1u, m_storageImageExtent.width);
+    extent.height = std::clamp(static_cast<uint32_t>(static_cast<float>(m_swapChainExtent.height) * scale), 1u, m_storageImageExtent.height);
+    return extent;
+}
+
+void VulkanRenderer::CreateComputeQueryPool()
+{
+    uint32_t queueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &queueFamilyCount, nullptr);
+
+    std::vector<VkQueueFamilyProperties> queueFamilies(queueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(m_physicalDevice, &queueFamilyCount, queueFamilies.data());
+
+    // No timestamps: no compute time, the resolution stays where it is
+    if (queueFamilies[m_queueFamily].timestampValidBits == 0)
+        return;
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+    m_timestampPeriod = properties.limits.timestampPeriod;
+
+    VkQueryPoolCreateInfo queryPoolInfo{};
+    queryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    queryPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    queryPoolInfo.queryCount = 2 * MAX_FRAMES_IN_FLIGHT;
+
+    if (vkCreateQueryPool(m_device, &queryPoolInfo, nullptr, &m_computeQueryPool) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create compute query pool!");
+}
+
+// Once the compute fence of the frame is signaled: reads its GPU time, then moves the render scale towards the budget
+void VulkanRenderer::UpdateDynamicResolution()
+{
+    if (!m_computeTimestampsWritten)
+        return;
+
+    std::array<uint64_t, 2> timestamps{};
+    if (vkGetQueryPoolResults(m_device, m_computeQueryPool, m_currentFrame * 2, 2, sizeof(timestamps), timestamps.data(),
+                              sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS)
+        return;
+
+    m_computeTime = static_cast<float>(static_cast<double>(timestamps[1] - timestamps[0]) * m_timestampPeriod * 1e-6);
+    if (!m_dynamicResolution || m_computeTime <= 0.f)
+        return;
+
+    // The cost follows the pixel count, the square of the scale. Down fast, up slowly,
+    // and not for a few percents so the resolution does not flicker.
+    const float budget = m_targetFrameTime * DYNAMIC_RESOLUTION_BUDGET;
+    const float ratio = std::clamp(std::sqrt(budget / m_computeTime), 0.8f, 1.05f);
+    if (std::abs(ratio - 1.f) > 0.02f)
+        m_renderScale = std::clamp(m_renderScale * ratio, MIN_RENDER_SCALE, MAX_RENDER_SCALE);
+}
+
 void VulkanRenderer::CreateComputePipeline()
 {
     if (m_computePipelineLayout != VK_NULL_HANDLE)
@@ -2080,10 +2600,26 @@ void VulkanRenderer::CreateComputePipeline()
         vkDestroyPipeline(m_device, m_computePipeline, nullptr);
         m_computePipeline = VK_NULL_HANDLE;
     }
+    for (VkPipeline* prepass : { &m_tileBinningPipeline, &m_reprojectionPipeline, &m_conePrepassPipeline })
+    {
+        if (*prepass != VK_NULL_HANDLE)
+        {
+            vkDestroyPipeline(m_device, *prepass, nullptr);
+            *prepass = VK_NULL_HANDLE;
+        }
+    }
 
     std::vector<uint32_t> shCode;
 
-    CompileShaderFromFile("shaders/basic_Raymarching.comp", shaderc_compute_shader, shCode);
+    std::vector<std::string> macros;
+    if (m_nodeFormat == NODE_FORMAT_COMPACT)
+        macros.push_back("COMPACT_NODES");
+    else if (m_nodeFormat == NODE_FORMAT_WIDE4)
+        macros.push_back("WIDE_BVH=4");
+    else if (m_nodeFormat == NODE_FORMAT_WIDE8)
+        macros.push_back("WIDE_BVH=8");
+
+    CompileShaderFromFile("shaders/basic_Raymarching.comp", shaderc_compute_shader, shCode, macros);
 
     const VkShaderModuleCreateInfo createInfo{
         .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
@@ -2126,6 +2662,39 @@ void VulkanRenderer::CreateComputePipeline()
         throw std::runtime_error("Failed to create compute pipeline!");
 
     vkDestroyShaderModule(m_device, m_computeShader, nullptr);
+
+    // The prepasses are the same shader built with one more macro: they decode the same node format
+    const auto createPrepass = [&](const std::string& macro, VkPipeline& pipeline)
+    {
+        std::vector<std::string> prepassMacros = macros;
+        prepassMacros.push_back(macro);
+
+        std::vector<uint32_t> prepassCode;
+        CompileShaderFromFile("shaders/basic_Raymarching.comp", shaderc_compute_shader, prepassCode, prepassMacros);
+
+        const VkShaderModuleCreateInfo prepassCreateInfo{
+            .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+            .pNext = nullptr,
+            .flags = 0u,
+            .codeSize = static_cast<uint32_t>(prepassCode.size()) * sizeof(uint32_t),
+            .pCode = prepassCode.data(),
+        };
+
+        VkShaderModule prepassShader;
+        if (vkCreateShaderModule(m_device, &prepassCreateInfo, nullptr, &prepassShader) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create " + macro + " shader module!");
+
+        pipelineInfo.stage.module = prepassShader;
+
+        if (vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &pipeline) != VK_SUCCESS)
+            throw std::runtime_error("Failed to create " + macro + " pipeline!");
+
+        vkDestroyShaderModule(m_device, prepassShader, nullptr);
+    };
+
+    createPrepass("TILE_BINNING", m_tileBinningPipeline);
+    createPrepass("TEMPORAL_REPROJECTION", m_reprojectionPipeline);
+    createPrepass("CONE_PREPASS", m_conePrepassPipeline);
 }
 
 void VulkanRenderer::CreateComputeDescriptorSetLayout()
@@ -2151,8 +2720,31 @@ void VulkanRenderer::CreateComputeDescriptorSetLayout()
     ssboLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
     ssboLayoutBinding.pImmutableSamplers = nullptr;
 
+    VkDescriptorSetLayoutBinding pointSSBOLayoutBinding{};
+    pointSSBOLayoutBinding.binding = 3;
+    pointSSBOLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pointSSBOLayoutBinding.descriptorCount = 1;
+    pointSSBOLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    pointSSBOLayoutBinding.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutBinding tileLayoutBinding{};
+    tileLayoutBinding.binding = 4;
+    tileLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    tileLayoutBinding.descriptorCount = 1;
+    tileLayoutBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    tileLayoutBinding.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutBinding temporalLayoutBinding = tileLayoutBinding;
+    temporalLayoutBinding.binding = 5;
 
-    std::array<VkDescriptorSetLayoutBinding, 3> bindings = { uboLayoutBinding, imageLayoutBinding, ssboLayoutBinding };
+    VkDescriptorSetLayoutBinding startBoundLayoutBinding = tileLayoutBinding;
+    startBoundLayoutBinding.binding = 6;
+
+    VkDescriptorSetLayoutBinding coneLayoutBinding = tileLayoutBinding;
+    coneLayoutBinding.binding = 7;
+
+    std::array<VkDescriptorSetLayoutBinding, 8> bindings = { uboLayoutBinding, imageLayoutBinding, ssboLayoutBinding, pointSSBOLayoutBinding,
+                                                             tileLayoutBinding, temporalLayoutBinding, startBoundLayoutBinding, coneLayoutBinding };
 
     VkDescriptorSetLayoutCreateInfo layoutInfo{};
     layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -2183,41 +2775,53 @@ void VulkanRenderer::CreateComputeDescriptorSets()
         uniformBufferInfo.offset = 0;
         uniformBufferInfo.range = sizeof(UniformBufferObject);
 
-        VkDescriptorImageInfo imageInfo{};
-        imageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageInfo.imageView = m_storageImageView;
-        imageInfo.sampler = VK_NULL_HANDLE;
+        VkWriteDescriptorSet descriptorWrite{};
+        descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrite.dstSet = m_computeDescriptorSets[i];
+        descriptorWrite.dstBinding = 0;
+        descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptorWrite.descriptorCount = 1;
+        descriptorWrite.pBufferInfo = &uniformBufferInfo;
+
+        vkUpdateDescriptorSets(m_device, 1, &descriptorWrite, 0, nullptr);
+    }
 
+    UpdateStorageImageDescriptors();
+    UpdateComputeSSBODescriptors();
+}
+
+// The SSBOs are recreated (and resized) on every model load, so their bindings are rewritten separately
+void VulkanRenderer::UpdateComputeSSBODescriptors()
+{
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+    {
         VkDescriptorBufferInfo ssboBufferInfo{};
         ssboBufferInfo.buffer = m_ssboBuffer;
         ssboBufferInfo.offset = 0;
-        ssboBufferInfo.range = sizeof(GPUNode) * MAX_NODES_SSBO + sizeof(glm::vec4) * 8;
+        ssboBufferInfo.range = VK_WHOLE_SIZE;
+
+        VkDescriptorBufferInfo pointSSBOBufferInfo{};
+        pointSSBOBufferInfo.buffer = m_pointSSBOBuffer;
+        pointSSBOBufferInfo.offset = 0;
+        pointSSBOBufferInfo.range = VK_WHOLE_SIZE;
 
-        std::array<VkWriteDescriptorSet, 3> descriptorWrites{};
+        std::array<VkWriteDescriptorSet, 2> descriptorWrites{};
 
-        // UBO
+        // Nodes
         descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         descriptorWrites[0].dstSet = m_computeDescriptorSets[i];
-        descriptorWrites[0].dstBinding = 0;
-        descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+        descriptorWrites[0].dstBinding = 2;
+        descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
         descriptorWrites[0].descriptorCount = 1;
-        descriptorWrites[0].pBufferInfo = &uniformBufferInfo;
+        descriptorWrites[0].pBufferInfo = &ssboBufferInfo;
 
-        // Storage image
+        // Points
         descriptorWrites[1].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
         descriptorWrites[1].dstSet = m_computeDescriptorSets[i];
-        descriptorWrites[1].dstBinding = 1;
-        descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        descriptorWrites[1].dstBinding = 3;
+        descriptorWrites[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
         descriptorWrites[1].descriptorCount = 1;
-        descriptorWrites[1].pImageInfo = &imageInfo;
-
-        // SSBO
-        descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-        descriptorWrites[2].dstSet = m_computeDescriptorSets[i];
-        descriptorWrites[2].dstBinding = 2;
-        descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-        descriptorWrites[2].descriptorCount = 1;
-        descriptorWrites[2].pBufferInfo = &ssboBufferInfo;
+        descriptorWrites[1].pBufferInfo = &pointSSBOBufferInfo;
 
         vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
     }
@@ -2274,41 +2878,191 @@ void VulkanRenderer::RecordComputeCommandBuffer(VkCommandBuffer commandBuffer) c
         TracyVkNamedZone(m_computeTracyVkCtx, computeZone, commandBuffer, "Compute Dispatch", true);
 #endif
 
-        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_computePipeline);
+        if (m_computeQueryPool != VK_NULL_HANDLE)
+        {
+            vkCmdResetQueryPool(commandBuffer, m_computeQueryPool, m_currentFrame * 2, 2);
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, m_computeQueryPool, m_currentFrame * 2);
+        }
 
         vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_computePipelineLayout, 0, 1, &m_computeDescriptorSets[m_currentFrame], 0, nullptr);
 
-        vkCmdDispatch(commandBuffer, (m_swapChainExtent.width * 2) / 16, (m_swapChainExtent.height * 2) / 16, 1);
+        const VkExtent2D renderExtent = GetRenderExtent();
+        const uint32_t groupCountX = (renderExtent.width + TILE_SIZE - 1) / TILE_SIZE;
+        const uint32_t groupCountY = (renderExtent.height + TILE_SIZE - 1) / TILE_SIZE;
+
+        // Prepasses filling buffers for the main pass, their outputs cleared first: tile leaf binning,
+        // reprojection of the distances written by the last frame, cone start distances
+        const bool tileBinning = m_traversalMode == TRAVERSAL_TILE_LEAVES;
+        const bool prepass = tileBinning || m_temporalUsable || m_conePrepass;
+        if (prepass)
+        {
+            if (tileBinning)
+                vkCmdFillBuffer(commandBuffer, m_tileBuffer, 0, sizeof(uint32_t) * m_tileCount, 0);
+            if (m_temporalUsable)
+                vkCmdFillBuffer(commandBuffer, m_startBoundBuffer, 0, VK_WHOLE_SIZE, 0xFFFFFFFFu);
+
+            // The distances come from the compute pass of the last frame, which read the buffers written now
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                                 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+
+        // Every leaf appended to the tiles its box covers
+        if (tileBinning)
+        {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_tileBinningPipeline);
+
+            // One invocation per leaf id (local_size_x = 64): every node, or every child slot of a wide node.
+            // Counted from the uploaded nodes, a tree loaded from its cache has no BinaryTree.
+            uint32_t leafIdCount = m_ssboNodeCount;
+            if (m_nodeFormat == NODE_FORMAT_WIDE4)
+                leafIdCount *= 4;
+            else if (m_nodeFormat == NODE_FORMAT_WIDE8)
+                leafIdCount *= 8;
+            vkCmdDispatch(commandBuffer, (leafIdCount + 63) / 64, 1, 1);
+        }
+
+        // One invocation per pixel of the last frame, same render size
+        if (m_temporalUsable)
+        {
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_reprojectionPipeline);
+            vkCmdDispatch(commandBuffer, groupCountX, groupCountY, 1);
+        }
+
+        // One invocation per block (local_size 8x8)
+        if (m_conePrepass)
+        {
+            const uint32_t blocksX = (renderExtent.width + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE;
+            const uint32_t blocksY = (renderExtent.height + CONE_BLOCK_SIZE - 1) / CONE_BLOCK_SIZE;
+
+            vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_conePrepassPipeline);
+            vkCmdDispatch(commandBuffer, (blocksX + 7) / 8, (blocksY + 7) / 8, 1);
+        }
+
+        if (prepass)
+        {
+            VkMemoryBarrier barrier{};
+            barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+            vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                                 1, &barrier, 0, nullptr, 0, nullptr);
+        }
+
+        vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_computePipeline);
+
+        // One workgroup per tile of the render extent, the last row and column partly outside
+        vkCmdDispatch(commandBuffer, groupCountX, groupCountY, 1);
+
+        if (m_computeQueryPool != VK_NULL_HANDLE)
+            vkCmdWriteTimestamp(commandBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_computeQueryPool, m_currentFrame * 2 + 1);
     }
 
     if (vkEndCommandBuffer(commandBuffer) != VK_SUCCESS)
         throw std::runtime_error("Failed to record compute command buffer!");
 }
 
-void VulkanRenderer::CreateSSBOBuffer()
+void VulkanRenderer::CreateSSBOBuffer(const GPUNode* nodes, size_t nodeCount, const glm::vec4* points, size_t pointCount)
 {
-    VkDeviceSize bufferSize = sizeof(GPUNode) * MAX_NODES_SSBO + sizeof(glm::vec4) * 8;
+    // Other surfaces: the last distances are no bound anymore
+    m_temporalHistoryValid = false;
+
+    SSBOHeader header{};
+    header.nodeInfo = glm::ivec4(static_cast<int>(nodeCount), static_cast<int>(pointCount), 0, 0);
 
-    SSBOData myDataArray = {};
+    const void* nodeData = nodes;
+    const void* pointData = points;
+    size_t nodeDataSize = sizeof(GPUNode) * nodeCount;
+    size_t pointDataSize = sizeof(glm::vec4) * pointCount;
 
-    // 2. Remplis ici myDataArray.nodes[...] et myDataArray.spheres[...]
-    // Par exemple :
-    // for (int i = 0; i < 512; ++i) myDataArray.nodes[i] = ...;
-    // for (int i = 0; i < 8; ++i) myDataArray.spheres[i] = ...;
+    // Packed at upload: the tree and its cache stay in the full format
+    std::vector<GPUNode> reorderedNodes;
+    CompactTree compactTree;
+    WideTree wideTree;
+    if (m_nodeFormat == NODE_FORMAT_BINARY)
+    {
+        m_depthFirstCacheLines = MeasureCacheLinesPerRay(nodes, nodeCount, m_sphereRadius);
+        m_nodeCacheLines = m_depthFirstCacheLines;
 
-    std::copy(m_binaryTree.GPUReadyBuffer.begin(), m_binaryTree.GPUReadyBuffer.begin() + std::min(m_binaryTree.GPUReadyBuffer.size(), size_t(MAX_NODES_SSBO)), myDataArray.SSBONodes);
+        if (m_nodeLayout != NODE_LAYOUT_DEPTH_FIRST)
+        {
+            reorderedNodes = ReorderNodes(nodes, nodeCount, m_nodeLayout, m_treeletSize);
+            m_nodeCacheLines = MeasureCacheLinesPerRay(reorderedNodes.data(), reorderedNodes.size(), m_sphereRadius);
+            nodeData = reorderedNodes.data();
+        }
+    }
+    else if (m_nodeFormat == NODE_FORMAT_COMPACT)
+    {
+        compactTree = PackCompactTree(nodes, nodeCount, points, pointCount);
+
+        header.quantMin = glm::vec4(compactTree.quantMin, 0);
+        header.quantStep = glm::vec4(compactTree.quantStep, 0);
+
+        nodeData = compactTree.nodes.data();
+        pointData = compactTree.points.data();
+        nodeDataSize = sizeof(GPUCompactNode) * compactTree.nodes.size();
+        pointDataSize = sizeof(glm::uvec2) * compactTree.points.size();
+    }
+    else if (m_nodeFormat == NODE_FORMAT_WIDE4 || m_nodeFormat == NODE_FORMAT_WIDE8)
+    {
+        wideTree = PackWideTree(nodes, nodeCount, m_nodeFormat == NODE_FORMAT_WIDE8 ? 8 : 4);
+
+        header.nodeInfo.x = static_cast<int>(wideTree.nodeCount);
+
+        nodeData = wideTree.lanes.data();
+        nodeDataSize = sizeof(GPUWideLanes) * wideTree.lanes.size();
+    }
+
+    // Sized from the tree: header + every node, and every point (at least one, empty buffers are not allowed)
+    VkDeviceSize bufferSize = sizeof(SSBOHeader) + nodeDataSize;
+    VkDeviceSize pointBufferSize = std::max<size_t>(pointDataSize, sizeof(glm::vec4));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(m_physicalDevice, &properties);
+
+    if (bufferSize > properties.limits.maxStorageBufferRange)
+        throw std::runtime_error("Binary tree does not fit in a storage buffer (" + std::to_string(bufferSize) + " bytes, max " +
+                                 std::to_string(properties.limits.maxStorageBufferRange) + ")!");
+    if (pointBufferSize > properties.limits.maxStorageBufferRange)
+        throw std::runtime_error("Point cloud does not fit in a storage buffer (" + std::to_string(pointBufferSize) + " bytes, max " +
+                                 std::to_string(properties.limits.maxStorageBufferRange) + ")!");
+
+    // Room to grow in place for a tree that is being updated (UploadTreeChanges)
+    if (m_treeLive)
+    {
+        const VkDeviceSize maxRange = properties.limits.maxStorageBufferRange;
+        bufferSize = std::min(static_cast<VkDeviceSize>(static_cast<double>(bufferSize) * LIVE_SSBO_HEADROOM), maxRange);
+        pointBufferSize = std::min(static_cast<VkDeviceSize>(static_cast<double>(pointBufferSize) * LIVE_SSBO_HEADROOM), maxRange);
+    }
+    m_ssboSize = bufferSize;
+    m_pointSSBOSize = pointBufferSize;
+    m_ssboNodeCount = static_cast<uint32_t>(header.nodeInfo.x);
+    m_treeGPUSize = static_cast<size_t>(bufferSize + pointBufferSize);
 
-    // 3. Création du buffer Vulkan
     CreateBuffer(bufferSize,
         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
         m_ssboBuffer, m_ssboMemory);
 
-    // 4. Copie des données dans le buffer
     void* data;
     vkMapMemory(m_device, m_ssboMemory, 0, bufferSize, 0, &data);
-    memcpy(data, &myDataArray, sizeof(SSBOData));
+    memcpy(data, &header, sizeof(SSBOHeader));
+    if (nodeDataSize > 0)
+        memcpy(static_cast<char*>(data) + sizeof(SSBOHeader), nodeData, nodeDataSize);
     vkUnmapMemory(m_device, m_ssboMemory);
+
+    CreateBuffer(pointBufferSize,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        m_pointSSBOBuffer, m_pointSSBOMemory);
+
+    vkMapMemory(m_device, m_pointSSBOMemory, 0, pointBufferSize, 0, &data);
+    if (pointDataSize > 0)
+        memcpy(data, pointData, pointDataSize);
+    vkUnmapMemory(m_device, m_pointSSBOMemory);
 }
 
 void VulkanRenderer::ComputeTransitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels, VkQueue queue, VkSemaphore waitOn, VkSemaphore signalOut, uint32_t index)
@@ -2417,6 +3171,397 @@ void VulkanRenderer::ComputeTransitionImageLayout(VkImage image, VkFormat format
         throw std::runtime_error("Failed to submit transition command buffer!");
 }
 
+void VulkanRenderer::BuildCachedTree()
+{
+    if (!m_treeFromCache || m_modelPaths.empty())
+        return;
+
+    const bool streamUpdates = m_streamUpdates;
+    const bool deformPoints = m_deformPoints;
+
+    m_skipTreeCache = true;
+    ReloadModel(m_modelPaths[m_currentModelIndex]);
+    m_skipTreeCache = false;
+
+    m_streamUpdates = streamUpdates;
+    m_deformPoints = deformPoints;
+}
+
+void VulkanRenderer::UpdateTree(size_t insertCount, size_t removeCount)
+{
+    BuildCachedTree();
+    if (m_vertices.empty())
+        return;
+
+    // New points are jittered copies of model points, so the cloud keeps its shape
+    const glm::vec3 cloudSize = m_binaryTree.GPUReadyBuffer.size() > 1 ? glm::vec3(m_binaryTree.GPUReadyBuffer[1].boxSize) : glm::vec3(0);
+    const float jitter = std::max(glm::length(cloudSize) * 0.002f, 1e-4f);
+    std::uniform_int_distribution<size_t> vertexDistribution(0, m_vertices.size() - 1);
+    std::normal_distribution<float> jitterDistribution(0.f, jitter);
+
+    std::vector<glm::vec3> inserted(insertCount);
+    for (glm::vec3& point : inserted)
+    {
+        point = m_vertices[vertexDistribution(m_updateRandom)].pos +
+                glm::vec3(jitterDistribution(m_updateRandom), jitterDistribution(m_updateRandom), jitterDistribution(m_updateRandom));
+    }
+
+    // Our own points go first, then model points (already removed ones are just not found)
+    std::vector<glm::vec3> removed;
+    removed.reserve(removeCount);
+    while (removed.size() < removeCount && !m_insertedPoints.empty())
+    {
+        removed.push_back(m_insertedPoints.front());
+        m_insertedPoints.pop_front();
+    }
+    while (removed.size() < removeCount)
+        removed.push_back(m_vertices[vertexDistribution(m_updateRandom)].pos);
+
+    std::chrono::high_resolution_clock::time_point updateStart = std::chrono::high_resolution_clock::now();
+    SyncDeformedTree();
+    m_binaryTree.Insert(inserted.data(), inserted.size());
+    m_binaryTree.Remove(removed.data(), removed.size());
+    m_treeUpdateTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - updateStart).count();
+
+    m_insertedPoints.insert(m_insertedPoints.end(), inserted.begin(), inserted.end());
+    m_treeLive = true;
+
+    // New topology and point slots, the waves go on from the current positions
+    m_restPoints.clear();
+    vkDeviceWaitIdle(m_device);
+    DestroyRefitBuffers();
+
+    UploadTreeChanges();
+}
+
+void VulkanRenderer::UploadTreeChanges()
+{
+    m_binaryTree.TakeChangedRanges(m_changedNodeRanges, m_changedPointRanges);
+    m_temporalHistoryValid = false;
+
+    const std::vector<GPUNode>& nodes = m_binaryTree.GPUReadyBuffer;
+    const std::vector<glm::vec4>& points = m_binaryTree.GPUReadyPoints;
+    const VkDeviceSize nodeBufferSize = sizeof(SSBOHeader) + sizeof(GPUNode) * nodes.size();
+    const VkDeviceSize pointBufferSize = std::max<size_t>(sizeof(glm::vec4) * points.size(), sizeof(glm::vec4));
+
+    // The frame in flight reads the same buffers
+    vkDeviceWaitIdle(m_device);
+
+    // The other formats and layouts are packed from the depth-first tree: compacted, then uploaded whole.
+    // So is a tree that outgrew its buffers.
+    const bool inPlace = m_nodeFormat == NODE_FORMAT_BINARY && m_nodeLayout == NODE_LAYOUT_DEPTH_FIRST;
+    if (!inPlace || nodeBufferSize > m_ssboSize || pointBufferSize > m_pointSSBOSize)
+    {
+        if (!inPlace)
+        {
+            m_binaryTree.Compact();
+            m_binaryTree.TakeChangedRanges(m_changedNodeRanges, m_changedPointRanges);
+        }
+
+        DestroySSBOBuffers();
+        CreateSSBOBuffer(nodes.data(), nodes.size(), points.data(), points.size());
+        UpdateComputeSSBODescriptors();
+        m_treeUploadBytes = m_treeGPUSize;
+        return;
+    }
+
+    m_treeUploadBytes = sizeof(SSBOHeader);
+
+    SSBOHeader header{};
+    header.nodeInfo = glm::ivec4(static_cast<int>(nodes.size()), static_cast<int>(points.size()), 0, 0);
+    m_ssboNodeCount = static_cast<uint32_t>(nodes.size());
+
+    void* data;
+    vkMapMemory(m_device, m_ssboMemory, 0, m_ssboSize, 0, &data);
+    memcpy(data, &header, sizeof(SSBOHeader));
+    for (const IndexRange& range : m_changedNodeRanges)
+    {
+        const size_t size = sizeof(GPUNode) * (range.last - range.first);
+        memcpy(static_cast<char*>(data) + sizeof(SSBOHeader) + sizeof(GPUNode) * range.first, &nodes[range.first], size);
+        m_treeUploadBytes += size;
+    }
+    vkUnmapMemory(m_device, m_ssboMemory);
+
+    vkMapMemory(m_device, m_pointSSBOMemory, 0, m_pointSSBOSize, 0, &data);
+    for (const IndexRange& range : m_changedPointRanges)
+    {
+        const size_t size = sizeof(glm::vec4) * (range.last - range.first);
+        memcpy(static_cast<char*>(data) + sizeof(glm::vec4) * range.first, &points[range.first], size);
+        m_treeUploadBytes += size;
+    }
+    vkUnmapMemory(m_device, m_pointSSBOMemory);
+}
+
+void VulkanRenderer::DeformPoints()
+{
+    BuildCachedTree();
+    const std::vector<glm::vec3>& points = m_binaryTree.generatedPoints;
+    if (points.empty())
+        return;
+
+    // Waves start from the current positions
+    if (m_restPoints.size() != points.size())
+    {
+        m_restPoints = points;
+        m_deformTime = 0.f;
+    }
+    m_deformTime += m_deltaTime;
+
+    const glm::vec3 cloudSize = glm::vec3(m_binaryTree.GPUReadyBuffer[1].boxSize);
+    const float amplitude = glm::length(cloudSize) * m_deformAmplitude;
+    const float waveNumber = 6.2831853f / std::max(cloudSize.y, 1e-6f);
+
+    // Zero at m_deformTime = 0 so a rebuild does not make the points jump
+    m_deformedPoints.resize(m_restPoints.size());
+    for (size_t i = 0; i < m_restPoints.size(); i++)
+    {
+        const glm::vec3& rest = m_restPoints[i];
+        const float phase = rest.y * waveNumber;
+        m_deformedPoints[i] = rest + glm::vec3(amplitude * (std::sin(2.f * m_deformTime + phase) - std::sin(phase)), 0.f, 0.f);
+    }
+
+    std::chrono::high_resolution_clock::time_point refitStart = std::chrono::high_resolution_clock::now();
+    if (m_refitOnGPU && m_nodeFormat == NODE_FORMAT_BINARY && m_nodeLayout == NODE_LAYOUT_DEPTH_FIRST)
+    {
+        // A simulation running on the GPU would write the point SSBO itself
+        vkDeviceWaitIdle(m_device);
+
+        void* data;
+        vkMapMemory(m_device, m_pointSSBOMemory, 0, m_pointSSBOSize, 0, &data);
+        glm::vec4* gpuPoints = static_cast<glm::vec4*>(data);
+        for (size_t i = 0; i < m_deformedPoints.size(); i++)
+            gpuPoints[i] = glm::vec4(m_deformedPoints[i], 1);
+        vkUnmapMemory(m_device, m_pointSSBOMemory);
+
+        RefitTreeOnGPU();
+        m_cpuTreeBehind = true;
+
+        // The refit boxes are read back and scored on the CPU
+        vkMapMemory(m_device, m_ssboMemory, 0, m_ssboSize, 0, &data);
+        const GPUNode* gpuNodes = reinterpret_cast<const GPUNode*>(static_cast<const char*>(data) + sizeof(SSBOHeader));
+        m_refitQuality = m_binaryTree.GetRefitQuality(gpuNodes, m_binaryTree.GPUReadyBuffer.size());
+        vkUnmapMemory(m_device, m_ssboMemory);
+        m_refitTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - refitStart).count();
+    }
+    else
+    {
+        if (m_refitPool == nullptr)
+            m_refitPool = std::make_unique<WorkStealingPool>(0);
+
+        m_refitQuality = m_binaryTree.Refit(m_deformedPoints.data(), m_deformedPoints.size(), m_refitPool.get());
+        UploadTreeChanges();
+        m_refitTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - refitStart).count();
+    }
+
+    if (m_autoRebuild && m_refitQuality > BinaryTree::REFIT_REBUILD_RATIO)
+        RebuildDeformedTree();
+}
+
+void VulkanRenderer::SyncDeformedTree()
+{
+    // The GPU refit only moved the point SSBO, the CPU tree takes the shown positions
+    if (m_cpuTreeBehind && m_deformedPoints.size() == m_binaryTree.generatedPoints.size())
+        m_binaryTree.Refit(m_deformedPoints.data(), m_deformedPoints.size());
+    m_cpuTreeBehind = false;
+}
+
+void VulkanRenderer::RebuildDeformedTree()
+{
+    BuildCachedTree();
+    SyncDeformedTree();
+
+    // Without the unused slots of the live updates
+    m_binaryTree.Compact();
+    std::vector<glm::vec3> points = m_binaryTree.generatedPoints;
+    if (points.empty())
+        return;
+
+    std::chrono::high_resolution_clock::time_point buildStart = std::chrono::high_resolution_clock::now();
+    m_binaryTree = BinaryTree(points, m_treeBuildSettings);
+    m_treeBuildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+
+    // The build sorted the points: the waves start again from here
+    m_restPoints.clear();
+    m_deformedPoints.clear();
+    m_refitQuality = 1.f;
+    m_insertedPoints.clear();
+
+    vkDeviceWaitIdle(m_device);
+    DestroySSBOBuffers();
+    CreateSSBOBuffer(m_binaryTree.GPUReadyBuffer.data(), m_binaryTree.GPUReadyBuffer.size(),
+                     m_binaryTree.GPUReadyPoints.data(), m_binaryTree.GPUReadyPoints.size());
+    UpdateComputeSSBODescriptors();
+    UpdateTreeStats(m_binaryTree.GPUReadyBuffer.data(), m_binaryTree.GPUReadyBuffer.size());
+}
+
+void VulkanRenderer::CreateRefitPipeline()
+{
+    std::array<VkDescriptorSetLayoutBinding, 4> bindings{};
+    for (uint32_t i = 0; i < bindings.size(); i++)
+    {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        bindings[i].pImmutableSamplers = nullptr;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo{};
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size());
+    layoutInfo.pBindings = bindings.data();
+
+    if (vkCreateDescriptorSetLayout(m_device, &layoutInfo, nullptr, &m_refitDescriptorSetLayout) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create refit descriptor set layout!");
+
+    VkDescriptorSetAllocateInfo allocInfo{};
+    allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    allocInfo.descriptorPool = m_descriptorPool;
+    allocInfo.descriptorSetCount = 1;
+    allocInfo.pSetLayouts = &m_refitDescriptorSetLayout;
+
+    if (vkAllocateDescriptorSets(m_device, &allocInfo, &m_refitDescriptorSet) != VK_SUCCESS)
+        throw std::runtime_error("Failed to allocate refit descriptor set!");
+
+    std::vector<uint32_t> shCode;
+    CompileShaderFromFile("shaders/refit.comp", shaderc_compute_shader, shCode);
+
+    const VkShaderModuleCreateInfo createInfo{
+        .sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .pNext = nullptr,
+        .flags = 0u,
+        .codeSize = static_cast<uint32_t>(shCode.size()) * sizeof(uint32_t),
+        .pCode = shCode.data(),
+    };
+
+    VkShaderModule shaderModule;
+    if (vkCreateShaderModule(m_device, &createInfo, nullptr, &shaderModule) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create refit shader module!");
+
+    VkPipelineShaderStageCreateInfo shaderStageInfo{};
+    shaderStageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    shaderStageInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    shaderStageInfo.module = shaderModule;
+    shaderStageInfo.pName = "main";
+
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+    pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipelineLayoutInfo.setLayoutCount = 1;
+    pipelineLayoutInfo.pSetLayouts = &m_refitDescriptorSetLayout;
+
+    if (vkCreatePipelineLayout(m_device, &pipelineLayoutInfo, nullptr, &m_refitPipelineLayout) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create refit pipeline layout!");
+
+    VkComputePipelineCreateInfo pipelineInfo{};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipelineInfo.layout = m_refitPipelineLayout;
+    pipelineInfo.stage = shaderStageInfo;
+
+    if (vkCreateComputePipelines(m_device, VK_NULL_HANDLE, 1, &pipelineInfo, nullptr, &m_refitPipeline) != VK_SUCCESS)
+        throw std::runtime_error("Failed to create refit pipeline!");
+
+    vkDestroyShaderModule(m_device, shaderModule, nullptr);
+}
+
+void VulkanRenderer::CreateRefitBuffers()
+{
+    const std::vector<int>& parents = m_binaryTree.GetParents();
+    const VkDeviceSize bufferSize = sizeof(int) * std::max<size_t>(parents.size(), 1);
+
+    CreateBuffer(bufferSize,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        m_refitParentBuffer, m_refitParentMemory);
+
+    void* data;
+    vkMapMemory(m_device, m_refitParentMemory, 0, bufferSize, 0, &data);
+    if (!parents.empty())
+        memcpy(data, parents.data(), sizeof(int) * parents.size());
+    vkUnmapMemory(m_device, m_refitParentMemory);
+
+    CreateBuffer(bufferSize,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        m_refitVisitBuffer, m_refitVisitMemory);
+
+    // Nodes, points, parents, visit counters
+    const std::array<VkBuffer, 4> buffers = { m_ssboBuffer, m_pointSSBOBuffer, m_refitParentBuffer, m_refitVisitBuffer };
+    std::array<VkDescriptorBufferInfo, 4> bufferInfos{};
+    std::array<VkWriteDescriptorSet, 4> descriptorWrites{};
+    for (uint32_t i = 0; i < buffers.size(); i++)
+    {
+        bufferInfos[i].buffer = buffers[i];
+        bufferInfos[i].offset = 0;
+        bufferInfos[i].range = VK_WHOLE_SIZE;
+
+        descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        descriptorWrites[i].dstSet = m_refitDescriptorSet;
+        descriptorWrites[i].dstBinding = i;
+        descriptorWrites[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        descriptorWrites[i].descriptorCount = 1;
+        descriptorWrites[i].pBufferInfo = &bufferInfos[i];
+    }
+
+    vkUpdateDescriptorSets(m_device, static_cast<uint32_t>(descriptorWrites.size()), descriptorWrites.data(), 0, nullptr);
+}
+
+void VulkanRenderer::DestroyRefitBuffers()
+{
+    if (m_refitParentBuffer != VK_NULL_HANDLE)
+    {
+        vkDestroyBuffer(m_device, m_refitParentBuffer, nullptr);
+        vkFreeMemory(m_device, m_refitParentMemory, nullptr);
+        m_refitParentBuffer = VK_NULL_HANDLE;
+        m_refitParentMemory = VK_NULL_HANDLE;
+    }
+
+    if (m_refitVisitBuffer != VK_NULL_HANDLE)
+    {
+        vkDestroyBuffer(m_device, m_refitVisitBuffer, nullptr);
+        vkFreeMemory(m_device, m_refitVisitMemory, nullptr);
+        m_refitVisitBuffer = VK_NULL_HANDLE;
+        m_refitVisitMemory = VK_NULL_HANDLE;
+    }
+}
+
+void VulkanRenderer::RefitTreeOnGPU()
+{
+    if (m_binaryTree.GPUReadyBuffer.size() <= 1)
+        return;
+
+    if (m_refitParentBuffer == VK_NULL_HANDLE)
+        CreateRefitBuffers();
+
+    m_temporalHistoryValid = false;
+
+    VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
+
+    vkCmdFillBuffer(commandBuffer, m_refitVisitBuffer, 0, VK_WHOLE_SIZE, 0);
+
+    VkMemoryBarrier barrier{};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_refitPipeline);
+    vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, m_refitPipelineLayout, 0, 1, &m_refitDescriptorSet, 0, nullptr);
+
+    // One invocation per node (local_size_x = 64 in refit.comp)
+    const uint32_t nodeCount = static_cast<uint32_t>(m_binaryTree.GPUReadyBuffer.size());
+    vkCmdDispatch(commandBuffer, (nodeCount + 63) / 64, 1, 1);
+
+    // DeformPoints reads the boxes back to score them
+    barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+                         1, &barrier, 0, nullptr, 0, nullptr);
+
+    // Waits for the queue: the next frame reads the refit boxes
+    EndSingleTimeCommands(commandBuffer);
+}
+
 void VulkanRenderer::DestroyBinaryTreeResources()
 {
     if (m_nodeBuffer != VK_NULL_HANDLE)
@@ -2443,4 +3588,33 @@ void VulkanRenderer::DestroyBinaryTreeResources()
         m_nodeDescriptorSetLayout = VK_NULL_HANDLE;
     }
 }
-#endif
\ No newline at end of file
+
+void VulkanRenderer::UpdateTreeStats(const GPUNode* nodes, size_t nodeCount)
+{
+    m_treeStats = ComputeTreeStats(nodes, nodeCount, m_treeBuildSettings.sphereRadius);
+    m_treeStats.gpuBytes = m_treeGPUSize;
+
+    if (m_treeFromCache)
+    {
+        m_treeStats.buildPhases = { { "cache load", m_treeBuildTime } };
+    }
+    else
+    {
+        m_treeStats.buildPhases = m_binaryTree.GetBuildPhases();
+        m_treeStats.cpuBytes = m_binaryTree.GetMemoryFootprint();
+    }
+}
+
+void VulkanRenderer::WriteTreeStatsReport() const
+{
+    // Like the tree cache, a report that cannot be written is not worth stopping for
+    try
+    {
+        WriteTreeStats(m_treeStats, m_treeStatsModel, m_treeStatsModel + ".stats.json");
+    }
+    catch (const std::exception& exception)
+    {
+        std::cerr << exception.what() << std::endl;
+    }
+}
+#endif
@@ -3,12 +3,21 @@
 #include <optional>
 #include <vector>
 #include <chrono>
+#include <deque>
 #include <filesystem>
+#include <memory>
+#include <random>
 #include <backends/imgui_impl_vulkan.h>
 #include <shaderc/shaderc.hpp>
 
 #include "model_parser.h"
 #include "binaryTree.h"
+#include "tree_cache.h"
+#include "compact_tree.h"
+#include "wide_tree.h"
+#include "node_layout.h"
+#include "tree_stats.h"
+#include "work_stealing_pool.h"
 #include "tracy/TracyVulkan.hpp"
 
 
@@ -16,7 +25,44 @@ constexpr uint32_t WIDTH = 800;
 constexpr uint32_t HEIGHT = 600;
 constexpr int MAX_FRAMES_IN_FLIGHT = 1;
 
-constexpr int MAX_NODES_SSBO = 2048;
+// Live updates allocate the SSBOs this much bigger so the tree can grow in place for a while
+constexpr float LIVE_SSBO_HEADROOM = 1.5f;
+
+// How basic_Raymarching.comp walks the tree for each distance query (settings1.w)
+enum TRAVERSAL_MODE
+{
+    TRAVERSAL_RAY = 0,        // full ray-vs-AABB traversal at every march step
+    TRAVERSAL_RAY_CACHED = 1, // leaves hit by the ray gathered once per ray / bounce
+    TRAVERSAL_NEAREST = 2,    // nodes pruned by their distance to the sample point
+    TRAVERSAL_TILE_LEAVES = 3, // leaves binned per screen tile by a prepass, then pruned by distance
+    TRAVERSAL_MODE_COUNT
+};
+
+// Screen tiles of TRAVERSAL_TILE_LEAVES: one per workgroup of basic_Raymarching.comp, and the leaves kept for each
+constexpr uint32_t TILE_SIZE = 16;
+constexpr uint32_t MAX_TILE_LEAVES = 256;
+
+// Pixels per side of the blocks of the cone prepass, one cone and one start distance per block
+constexpr uint32_t CONE_BLOCK_SIZE = 8;
+
+// Render resolution of the compute pass per side, relative to the swapchain. The storage image is allocated
+// for the maximum, the compute pass writes its top left corner and compute_Raymarching.frag scales it up.
+constexpr float MIN_RENDER_SCALE = 0.25f;
+constexpr float MAX_RENDER_SCALE = 2.f;
+
+// Share of the target frame time the dynamic resolution gives to the compute pass,
+// the rest goes to the upscale, ImGui and the present
+constexpr float DYNAMIC_RESOLUTION_BUDGET = 0.8f;
+
+// Layout of the tree in the node SSBO, the compute shader is built for one of them
+enum NODE_FORMAT
+{
+    NODE_FORMAT_BINARY = 0,  // GPUNode, as built
+    NODE_FORMAT_COMPACT = 1, // GPUCompactNode + 16 bits points (COMPACT_NODES)
+    NODE_FORMAT_WIDE4 = 2,   // GPUWideLanes, 4 children per node (WIDE_BVH=4)
+    NODE_FORMAT_WIDE8 = 3,   // GPUWideLanes, 8 children per node (WIDE_BVH=8)
+    NODE_FORMAT_COUNT
+};
 
 const std::vector<const char*> validationLayers = {"VK_LAYER_KHRONOS_validation"};
 const std::vector<const char*> deviceExtensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
@@ -44,7 +90,8 @@ inline void DestroyDebugUtilsMessengerEXT(VkInstance instance, VkDebugUtilsMesse
         func(instance, debugMessenger, pAllocator);
 }
 
-inline bool CompileShaderFromFile(const std::string& _path, shaderc_shader_kind _stage, std::vector<uint32_t>& _out)
+inline bool CompileShaderFromFile(const std::string& _path, shaderc_shader_kind _stage, std::vector<uint32_t>& _out,
+                                  const std::vector<std::string>& _macros = {})
 {
     // Read File
     std::string code;
@@ -70,6 +117,16 @@ inline bool CompileShaderFromFile(const std::string& _path, shaderc_shader_kind
 
     shaderc::CompileOptions options;
 
+    // "NAME" or "NAME=VALUE"
+    for (const std::string& macro : _macros)
+    {
+        const size_t equal = macro.find('=');
+        if (equal == std::string::npos)
+            options.AddMacroDefinition(macro);
+        else
+            options.AddMacroDefinition(macro.substr(0, equal), macro.substr(equal + 1));
+    }
+
 #if NDEBUG
     options.SetOptimizationLevel(shaderc_optimization_level_zero);
 #else
@@ -129,9 +186,17 @@ struct SwapChainSupportDetails
     std::vector<VkPresentModeKHR> presentModes;
 };
 
-struct alignas(16) SSBOData
+// Start of the node SSBO, followed by the runtime sized GPUNode (or GPUCompactNode, GPUWideLanes) array
+struct alignas(16) SSBOHeader
 {
-    alignas(16) GPUNode SSBONodes[MAX_NODES_SSBO];
+    alignas(16) glm::ivec4 nodeInfo;
+    // x = node count
+    // y = point count (point SSBO)
+    // zw = unused
+
+    // Compact format only (CompactTree), .w = unused
+    alignas(16) glm::vec4 quantMin;
+    alignas(16) glm::vec4 quantStep;
 };
 
 struct UniformBufferObject
@@ -141,7 +206,7 @@ struct UniformBufferObject
     // x = lighting (int)
     // y = boxDebug (int)
     // z = randomColor (int)
-    // w = unused
+    // w = traversalMode (int)
 
     // Groupe 2 : floats divers
     alignas(16) glm::vec4 settings2;
@@ -150,10 +215,11 @@ struct UniformBufferObject
     // z = blendingFactor
     // w = far
 
-    // Groupe 3 : reflectivity et padding
+    // Groupe 3 : reflectivity, render size et padding
     alignas(16) glm::vec4 settings3;
     // x = reflectivity
-    // yzw = unused
+    // yz = render size in pixels, the part of the storage image written by the compute pass
+    // w = unused
 
     alignas(16) glm::vec4 lightingDir;
     alignas(16) glm::vec4 objectColor;
@@ -163,6 +229,20 @@ struct UniformBufferObject
 #if !COMPUTE
     alignas(16) glm::vec4 spheresArray[8];// w values are for sizes
     alignas(16) glm::ivec4 sphereNumber;
+#else
+    // Camera of the previous frame, its hit distances are reprojected with it
+    alignas(16) glm::vec4 previousCameraPos;
+    alignas(16) glm::vec4 previousCameraFront;
+
+    alignas(16) glm::vec4 temporal;
+    // x = reprojection on, the compute pass writes its hit distances (int)
+    // y = history usable, the primary rays start from the reprojected distances (int)
+    // z = half of the history written this frame (int)
+    // w = unused
+
+    alignas(16) glm::vec4 conePrepass;
+    // x = cone prepass on, the primary rays start from the distance of their block (int)
+    // yzw = unused
 #endif
 };
 
@@ -188,10 +268,23 @@ private:
     bool m_lighting = true;
     bool m_boxDebug = false;
     bool m_randomColor = false;
+    int m_traversalMode = TRAVERSAL_RAY_CACHED;
     float m_reflectivity = 0.0f;
     glm::vec3 m_lightingDir = glm::vec3(1.0, -1.0, -1.0);
     glm::vec3 m_objectColor = glm::vec3(1.0, 0.0, 0.0);
 
+    // Resolution of the compute pass, MIN_RENDER_SCALE to MAX_RENDER_SCALE of the swapchain.
+    // The dynamic resolution drives it from the GPU time of the compute pass.
+    float m_renderScale = MAX_RENDER_SCALE;
+    bool m_dynamicResolution = false;
+    float m_targetFrameTime = 1000.f / 60.f; // ms
+    float m_computeTime = 0.f; // ms, last compute pass (timestamps)
+
+    // Primary rays start from the hit distances of the previous frame, reprojected
+    bool m_temporalReprojection = false;
+    // and from the distance a cone marched at low resolution found free for their block
+    bool m_conePrepass = false;
+
     // Camera
     glm::vec3 m_cameraPos = glm::vec3(0.0f, 0.0f, -3.0f);
     glm::vec3 m_cameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
@@ -223,7 +316,35 @@ private:
 
     VkBuffer m_ssboBuffer = VK_NULL_HANDLE;
     VkDeviceMemory m_ssboMemory = VK_NULL_HANDLE;
+    VkBuffer m_pointSSBOBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory m_pointSSBOMemory = VK_NULL_HANDLE;
     BinaryTree m_binaryTree;
+    BinaryTreeBuildSettings m_treeBuildSettings;
+    float m_treeBuildTime = 0.f; // ms
+    bool m_treeFromCache = false; // last tree was mapped from its .tree file instead of built
+    bool m_skipTreeCache = false; // the next load parses and builds even when the .tree file is valid
+    int m_nodeFormat = NODE_FORMAT_BINARY; // NODE_FORMAT of the node SSBO and of the compute shader
+    int m_nodeLayout = NODE_LAYOUT_DEPTH_FIRST; // NODE_LAYOUT of the binary format
+    int m_treeletSize = DEFAULT_TREELET_SIZE;
+    float m_nodeCacheLines = 0.f; // MeasureCacheLinesPerRay of the uploaded nodes
+    float m_depthFirstCacheLines = 0.f; // and of the same nodes as built
+    size_t m_treeGPUSize = 0; // bytes of the node and point SSBOs
+    VkDeviceSize m_ssboSize = 0; // allocated, the live updates write in place while the tree fits
+    VkDeviceSize m_pointSSBOSize = 0;
+    uint32_t m_ssboNodeCount = 0; // nodeInfo.x of the uploaded header, in wide nodes for the wide formats
+    TreeStats m_treeStats; // of the loaded tree, kept with the live updates by Refresh only
+    std::string m_treeStatsModel; // path of the model, the report goes next to it after every load
+
+    // Live updates of m_binaryTree, jittered copies of the model points come and go
+    bool m_treeLive = false; // updated since the load: the SSBOs get LIVE_SSBO_HEADROOM
+    bool m_streamUpdates = false; // one batch every frame
+    int m_updateBatchSize = 1000;
+    float m_treeUpdateTime = 0.f; // ms, Insert + Remove of the last batch
+    size_t m_treeUploadBytes = 0; // written to the SSBOs by the last batch
+    std::deque<glm::vec3> m_insertedPoints; // removed first, oldest first
+    std::mt19937 m_updateRandom;
+    std::vector<IndexRange> m_changedNodeRanges;
+    std::vector<IndexRange> m_changedPointRanges;
 
     // Vulkan base
     VkInstance               m_instance = VK_NULL_HANDLE;
@@ -306,6 +427,9 @@ private:
     VkShaderModule   m_computeShader = VK_NULL_HANDLE;
     VkPipelineLayout m_computePipelineLayout = VK_NULL_HANDLE;
     VkPipeline       m_computePipeline = VK_NULL_HANDLE;
+    VkPipeline       m_tileBinningPipeline = VK_NULL_HANDLE; // same shader and layout, built with TILE_BINNING
+    VkPipeline       m_reprojectionPipeline = VK_NULL_HANDLE; // and with TEMPORAL_REPROJECTION
+    VkPipeline       m_conePrepassPipeline = VK_NULL_HANDLE; // and with CONE_PREPASS
 
     VkQueue m_computeQueue = VK_NULL_HANDLE;
 
@@ -332,6 +456,35 @@ private:
     VkDeviceMemory m_storageImageMemory = VK_NULL_HANDLE;
     VkImageView    m_storageImageView = VK_NULL_HANDLE;
     VkImageLayout  m_storageImageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkExtent2D     m_storageImageExtent = {}; // swapchain at MAX_RENDER_SCALE
+
+    // Timestamps around the compute pass, 2 per frame in flight
+    VkQueryPool m_computeQueryPool = VK_NULL_HANDLE; // stays null without timestamp support
+    float       m_timestampPeriod = 1.f; // ns per tick
+    bool        m_computeTimestampsWritten = false;
+
+    // Tile leaf lists of TRAVERSAL_TILE_LEAVES (binding 4): a counter per tile, then MAX_TILE_LEAVES entries per tile
+    VkBuffer       m_tileBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory m_tileBufferMemory = VK_NULL_HANDLE;
+    uint32_t       m_tileCount = 0;
+
+    // Temporal reprojection, sized from the storage image: distances reached by the primary rays in two halves,
+    // one written per frame (binding 5), and the start bounds reprojected from the other one (binding 6)
+    VkBuffer       m_temporalBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory m_temporalBufferMemory = VK_NULL_HANDLE;
+    VkBuffer       m_startBoundBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory m_startBoundBufferMemory = VK_NULL_HANDLE;
+    uint32_t       m_temporalHalf = 0; // written this frame
+    bool           m_temporalHistoryValid = false; // the other half is the last frame, with the same tree
+    bool           m_temporalUsable = false; // this frame starts its rays from it
+    glm::vec3      m_previousCameraPos = glm::vec3(0.0f);
+    glm::vec3      m_previousCameraFront = glm::vec3(0.0f, 0.0f, -1.0f);
+    VkExtent2D     m_previousRenderExtent = {};
+    glm::vec3      m_previousSurfaceSettings = glm::vec3(0.0f); // radius, blending, box debug: they move the surfaces
+
+    // Start distance per CONE_BLOCK_SIZE block of the storage image (binding 7), written by the cone prepass
+    VkBuffer       m_coneBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory m_coneBufferMemory = VK_NULL_HANDLE;
 
     // Node buffer (used for compute tree)
     VkBuffer              m_nodeBuffer = VK_NULL_HANDLE;
@@ -339,6 +492,29 @@ private:
     VkDescriptorSetLayout m_nodeDescriptorSetLayout = VK_NULL_HANDLE;
     VkDescriptorPool      m_nodeDescriptorPool      = VK_NULL_HANDLE;
 
+    // GPU refit (refit.comp) of the node SSBO in place, buffers made on first use for the current topology
+    VkDescriptorSetLayout m_refitDescriptorSetLayout = VK_NULL_HANDLE;
+    VkPipelineLayout      m_refitPipelineLayout = VK_NULL_HANDLE;
+    VkPipeline            m_refitPipeline = VK_NULL_HANDLE;
+    VkDescriptorSet       m_refitDescriptorSet = VK_NULL_HANDLE;
+    VkBuffer              m_refitParentBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory        m_refitParentMemory = VK_NULL_HANDLE;
+    VkBuffer              m_refitVisitBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory        m_refitVisitMemory = VK_NULL_HANDLE;
+
+    // Deformation demo: the points wave around m_restPoints and the tree is refit every frame
+    bool m_deformPoints = false;
+    bool m_refitOnGPU = false; // binary depth-first format only, the CPU tree keeps its old positions
+    bool m_cpuTreeBehind = false; // the GPU refit ran since the last SyncDeformedTree
+    bool m_autoRebuild = false; // once the refit quality passes BinaryTree::REFIT_REBUILD_RATIO
+    float m_deformAmplitude = 0.05f; // of the cloud size
+    float m_deformTime = 0.f;
+    float m_refitTime = 0.f; // ms
+    float m_refitQuality = 1.f;
+    std::vector<glm::vec3> m_restPoints; // generatedPoints order
+    std::vector<glm::vec3> m_deformedPoints;
+    std::unique_ptr<WorkStealingPool> m_refitPool;
+
     // Submission
     VkSubmitInfo m_computeSubmitInfo = {};
 #endif
@@ -430,6 +606,7 @@ private:
     void LoadModel(const std::string& path);
     void ReloadModel(const std::string& path);
     void DestroyModelResources();
+    void DestroySSBOBuffers();
 
     // Inputs & Timings
     float GetDeltaTime();
@@ -438,14 +615,53 @@ private:
     // Compute
     #if COMPUTE
     void CreateStorageImage();
+    void CreateTileBuffer();
+    void DestroyStorageImage();
+    void DestroyTileBuffer();
+    void RecreateStorageImage();
+    void UpdateStorageImageDescriptors();
+    VkExtent2D GetRenderExtent() const;
+    void CreateComputeQueryPool();
+    void UpdateDynamicResolution();
+    void CreateTemporalBuffers();
+    void DestroyTemporalBuffers();
+    void CreateConeBuffer();
+    void DestroyConeBuffer();
+    void BeginTemporalFrame();
+    void EndTemporalFrame();
     void CreateComputePipeline();
     void CreateComputeDescriptorSetLayout();
     void CreateComputeDescriptorSets();
+    void UpdateComputeSSBODescriptors();
     void CreateComputeCommandBuffers();
     void RecordComputeCommandBuffer(VkCommandBuffer commandBuffer) const;
-	void CreateSSBOBuffer();
+	void CreateSSBOBuffer(const GPUNode* nodes, size_t nodeCount, const glm::vec4* points, size_t pointCount);
     void ComputeTransitionImageLayout(VkImage image, VkFormat format, VkImageLayout oldLayout, VkImageLayout newLayout, uint32_t mipLevels, VkQueue queue, VkSemaphore waitOn, VkSemaphore signalOut, uint32_t index);
     void DestroyBinaryTreeResources();
+
+    // The live updates and the deformation change m_binaryTree, a cached tree has none:
+    // the model is loaded again without the cache, the live settings kept
+    void BuildCachedTree();
+
+    // Inserts insertCount points and removes removeCount, then uploads what changed
+    void UpdateTree(size_t insertCount, size_t removeCount);
+    void UploadTreeChanges();
+
+    // Deformation demo step: moves the points, then refits on the CPU or on the GPU
+    void DeformPoints();
+    void RebuildDeformedTree();
+
+    // Before the CPU tree changes or is read: refits it to m_deformedPoints if the GPU refit ran since
+    void SyncDeformedTree();
+
+    void CreateRefitPipeline();
+    void CreateRefitBuffers();
+    void DestroyRefitBuffers();
+    void RefitTreeOnGPU();
+
+    // Statistics of the binary nodes as built (before any format or layout), then the JSON report
+    void UpdateTreeStats(const GPUNode* nodes, size_t nodeCount);
+    void WriteTreeStatsReport() const;
     #endif
 #pragma endregion
 };
\ No newline at end of file
@@ -0,0 +1,184 @@
+#include "wide_tree.h"
+
+#include <algorithm>
+#include <limits>
+#include <stdexcept>
+
+namespace
+{
+   // Empty slots never pass a box test: inverted boxes, and a count the traversals skip
+   const GPUWideLanes EMPTY_WIDE_LANES = {
+      glm::vec4(std::numeric_limits<float>::max()), glm::vec4(std::numeric_limits<float>::max()),
+      glm::vec4(std::numeric_limits<float>::max()), glm::vec4(-std::numeric_limits<float>::max()),
+      glm::vec4(-std::numeric_limits<float>::max()), glm::vec4(-std::numeric_limits<float>::max()),
+      glm::ivec4(0), glm::ivec4(-1)
+   };
+
+   float SurfaceArea(const GPUNode& node)
+   {
+      const glm::vec3 size = glm::vec3(node.boxSize);
+      return size.x * size.y + size.y * size.z + size.z * size.x;
+   }
+
+   bool IsValidChild(int child, size_t nodeCount)
+   {
+      return child > 0 && static_cast<size_t>(child) < nodeCount;
+   }
+
+   // Nodes in the subtree under nodeIndex, it ends at its skip index in the depth-first layout
+   size_t SubtreeNodeCount(const GPUNode* nodes, size_t nodeCount, int nodeIndex)
+   {
+      const int skip = nodes[nodeIndex].children.z;
+      return (skip > nodeIndex ? static_cast<size_t>(skip) : nodeCount) - static_cast<size_t>(nodeIndex);
+   }
+
+   // Points a binary node goes into a single leaf lane with: its own for a leaf, MAX_POINTS_PER_LEAVES at most
+   // for a subtree whose leaves hold one contiguous range (first point of the node box = .x, count = .y). 0 = no lane.
+   // Small sibling leaves (SAH, LBVH) merge this way, otherwise a wide node bottoms out with two leaves.
+   std::vector<glm::ivec2> GetLeafLanes(const GPUNode* nodes, size_t nodeCount)
+   {
+      std::vector<glm::ivec2> leafLanes(nodeCount, glm::ivec2(0, 0));
+
+      // Children come after their parent in the depth-first layout: backwards, every child is done before its parent
+      for (size_t i = nodeCount - 1; i >= 1; i--)
+      {
+         const glm::ivec4 children = nodes[i].children;
+         if (children.w > 0)
+         {
+            leafLanes[i] = glm::ivec2(children.x, children.w);
+            continue;
+         }
+         if (!IsValidChild(children.x, nodeCount) || !IsValidChild(children.y, nodeCount) ||
+             static_cast<size_t>(children.x) <= i || static_cast<size_t>(children.y) <= i)
+            throw std::runtime_error("Wide BVH needs a valid binary tree");
+
+         const glm::ivec2 left = leafLanes[children.x];
+         const glm::ivec2 right = leafLanes[children.y];
+         if (left.y > 0 && right.y > 0 && left.x + left.y == right.x && left.y + right.y <= MAX_POINTS_PER_LEAVES)
+            leafLanes[i] = glm::ivec2(left.x, left.y + right.y);
+      }
+
+      return leafLanes;
+   }
+
+   // Appends the wide node collapsing the binary node binaryIndex and its subtree in depth-first order, returns its index.
+   // depth is the one of the appended subtree.
+   int EmitWideNodeRecursive(const GPUNode* nodes, size_t nodeCount, const std::vector<glm::ivec2>& leafLanes, int binaryIndex,
+                             WideTree& tree, int& depth)
+   {
+      // Binary nodes that become the children of this wide node, kept in depth-first order
+      int children[WIDE_MAX_WIDTH];
+      int childCount = 0;
+
+      // Only a root can be a leaf here: it becomes the single child of its wide node
+      if (leafLanes[binaryIndex].y > 0)
+      {
+         children[childCount++] = binaryIndex;
+      }
+      else
+      {
+         children[childCount++] = nodes[binaryIndex].children.x;
+         children[childCount++] = nodes[binaryIndex].children.y;
+      }
+
+      while (childCount < tree.width)
+      {
+         // Biggest subtree first so nodes fill evenly (surface area alone leaves flat or skewed clouds half empty),
+         // the biggest box between equal subtrees
+         int widest = -1;
+         float widestArea = -1.f;
+         size_t widestSize = 0;
+         for (int c = 0; c < childCount; c++)
+         {
+            if (!IsValidChild(children[c], nodeCount))
+               throw std::runtime_error("Wide BVH needs a valid binary tree");
+
+            const GPUNode& child = nodes[children[c]];
+            if (leafLanes[children[c]].y > 0)
+               continue;
+
+            const float area = SurfaceArea(child);
+            const size_t size = SubtreeNodeCount(nodes, nodeCount, children[c]);
+            if (size > widestSize || (size == widestSize && area > widestArea))
+            {
+               widest = c;
+               widestArea = area;
+               widestSize = size;
+            }
+         }
+
+         if (widest < 0)
+            break;
+
+         // The opened node is replaced by its left child, its right child goes right after it
+         const glm::ivec4 opened = nodes[children[widest]].children;
+         std::copy_backward(children + widest + 1, children + childCount, children + childCount + 1);
+         children[widest] = opened.x;
+         children[widest + 1] = opened.y;
+         childCount++;
+      }
+
+      const int laneGroups = tree.width / WIDE_LANE_COUNT;
+      const int wideIndex = static_cast<int>(tree.nodeCount++);
+      tree.lanes.resize(tree.nodeCount * laneGroups, EMPTY_WIDE_LANES);
+
+      for (int c = 0; c < childCount; c++)
+      {
+         if (!IsValidChild(children[c], nodeCount))
+            throw std::runtime_error("Wide BVH needs a valid binary tree");
+
+         const GPUNode& child = nodes[children[c]];
+         GPUWideLanes& lanes = tree.lanes[wideIndex * laneGroups + c / WIDE_LANE_COUNT];
+         const int lane = c % WIDE_LANE_COUNT;
+
+         lanes.minX[lane] = child.boxPos.x;
+         lanes.minY[lane] = child.boxPos.y;
+         lanes.minZ[lane] = child.boxPos.z;
+         lanes.maxX[lane] = child.boxPos.x + child.boxSize.x;
+         lanes.maxY[lane] = child.boxPos.y + child.boxSize.y;
+         lanes.maxZ[lane] = child.boxPos.z + child.boxSize.z;
+         lanes.child[lane] = leafLanes[children[c]].x;
+         lanes.count[lane] = leafLanes[children[c]].y;
+      }
+
+      // Internal children are emitted once every lane of this node is written: lanes grows under the recursion
+      int deepestChild = 0;
+      for (int c = 0; c < childCount; c++)
+      {
+         if (leafLanes[children[c]].y > 0)
+            continue;
+
+         int childDepth = 0;
+         const int childIndex = EmitWideNodeRecursive(nodes, nodeCount, leafLanes, children[c], tree, childDepth);
+         tree.lanes[wideIndex * laneGroups + c / WIDE_LANE_COUNT].child[c % WIDE_LANE_COUNT] = childIndex;
+
+         deepestChild = std::max(deepestChild, childDepth);
+      }
+
+      depth = deepestChild + 1;
+      return wideIndex;
+   }
+}
+
+WideTree PackWideTree(const GPUNode* nodes, size_t nodeCount, int width)
+{
+   if (width != 4 && width != WIDE_MAX_WIDTH)
+      throw std::runtime_error("Wide BVH width must be 4 or 8");
+
+   WideTree tree;
+   tree.width = width;
+
+   // Index 0 is unused, the root is at 1
+   tree.nodeCount = 1;
+   tree.lanes.resize(width / WIDE_LANE_COUNT, EMPTY_WIDE_LANES);
+
+   if (nodeCount <= 1)
+      return tree;
+
+   // Every level collapses at least one binary level, so MAX_TREE_DEPTH already keeps this in the stack
+   EmitWideNodeRecursive(nodes, nodeCount, GetLeafLanes(nodes, nodeCount), 1, tree, tree.depth);
+   if (tree.depth > WIDE_STACK_SIZE)
+      throw std::runtime_error("Wide BVH deeper than the shader traversal stack (WIDE_STACK_SIZE)");
+
+   return tree;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "binaryTree.h"
+
+// Children per GPUWideLanes, a wide node is 1 (4-wide) or 2 (8-wide) of them
+constexpr int WIDE_LANE_COUNT = 4;
+constexpr int WIDE_MAX_WIDTH = 8;
+
+// Traversal stack of the wide shader paths (WIDE_STACK_SIZE in basic_Raymarching.comp):
+// one entry per wide level, the node and the children still to visit
+constexpr int WIDE_STACK_SIZE = 64;
+
+// Bounds of 4 children side by side, so one fetch tests them all at once
+struct alignas(16) GPUWideLanes
+{
+   glm::vec4 minX;
+   glm::vec4 minY;
+   glm::vec4 minZ;
+   glm::vec4 maxX;
+   glm::vec4 maxY;
+   glm::vec4 maxZ;
+   glm::ivec4 child;   // wide node index of an internal child, first point of a leaf child
+   glm::ivec4 count;   // point count of a leaf child, 0 for an internal child, -1 for an empty slot
+};
+
+// Binary tree collapsed into a 4 or 8-wide BVH, decoded by the compute shader built with WIDE_BVH.
+// The points are unchanged: leaf children keep their GPUReadyPoints range.
+struct WideTree
+{
+   int width = WIDE_LANE_COUNT;
+
+   // Node i is lanes[i * width / WIDE_LANE_COUNT, (i + 1) * width / WIDE_LANE_COUNT).
+   // Node 0 stays unused like in GPUReadyBuffer, the root is node 1.
+   std::vector<GPUWideLanes> lanes;
+   size_t nodeCount = 0;
+
+   // Wide levels from the root to the deepest leaf
+   int depth = 0;
+};
+
+// Each wide node takes the children of a binary node and keeps opening its biggest internal child
+// until it has width children. A subtree of small sibling leaves (MAX_POINTS_PER_LEAVES points at most)
+// is a single leaf child. Nodes are written in depth-first order.
+// Throws std::runtime_error for another width or a broken binary tree.
+WideTree PackWideTree(const GPUNode* nodes, size_t nodeCount, int width);
@@ -0,0 +1,211 @@
+#include "work_stealing_pool.h"
+
+#include <algorithm>
+#include <chrono>
+
+namespace
+{
+   // Which pool / deque the current thread works for
+   thread_local const WorkStealingPool* t_pool = nullptr;
+   thread_local unsigned int t_queueIndex = 0;
+}
+
+#pragma region WORK STEALING POOL
+WorkStealingPool::WorkStealingPool(unsigned int threadCount)
+{
+   if (threadCount == 0)
+      threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+   // The thread waiting on a TaskGroup works too
+   const unsigned int workerCount = threadCount - 1;
+
+   for (unsigned int i = 0; i < workerCount + 1; i++)
+      m_queues.push_back(std::make_unique<WorkerQueue>());
+
+   for (unsigned int i = 0; i < workerCount; i++)
+      m_workers.emplace_back(&WorkStealingPool::WorkerLoop, this, i);
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+   {
+      std::lock_guard<std::mutex> lock(m_sleepMutex);
+      m_stop = true;
+   }
+   m_sleepCondition.notify_all();
+
+   for (std::thread& worker : m_workers)
+      worker.join();
+}
+
+unsigned int WorkStealingPool::GetThreadCount() const
+{
+   return static_cast<unsigned int>(m_workers.size()) + 1;
+}
+
+void WorkStealingPool::Submit(std::function<void()> task)
+{
+   WorkerQueue& queue = *m_queues[GetQueueIndex()];
+   {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(m_sleepMutex);
+      ++m_pendingTasks;
+   }
+   m_sleepCondition.notify_one();
+}
+
+bool WorkStealingPool::RunPendingTask()
+{
+   const unsigned int index = GetQueueIndex();
+
+   std::function<void()> task;
+   if (!PopTask(index, task) && !StealTask(index, task))
+      return false;
+
+   task();
+   return true;
+}
+
+void WorkStealingPool::ParallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& function)
+{
+   if (end <= begin)
+      return;
+
+   // A few chunks per thread so stealing can even out uneven chunks
+   const size_t count = end - begin;
+   const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(GetThreadCount() * 4, count / std::max<size_t>(grainSize, 1)));
+   const size_t chunkSize = (count + chunkCount - 1) / chunkCount;
+
+   TaskGroup group(*this);
+   for (size_t chunkBegin = begin + chunkSize; chunkBegin < end; chunkBegin += chunkSize)
+   {
+      const size_t chunkEnd = std::min(chunkBegin + chunkSize, end);
+      group.Run([&function, chunkBegin, chunkEnd]() { function(chunkBegin, chunkEnd); });
+   }
+
+   function(begin, std::min(begin + chunkSize, end));
+   group.Wait();
+}
+
+void WorkStealingPool::WorkerLoop(unsigned int index)
+{
+   t_pool = this;
+   t_queueIndex = index;
+
+   while (!m_stop)
+   {
+      std::function<void()> task;
+      if (PopTask(index, task) || StealTask(index, task))
+      {
+         task();
+         continue;
+      }
+
+      // Nothing to steal: sleep until something is submitted (timeout in case of a lost wake up)
+      std::unique_lock<std::mutex> lock(m_sleepMutex);
+      m_sleepCondition.wait_for(lock, std::chrono::milliseconds(10), [this]() { return m_stop || m_pendingTasks > 0; });
+   }
+}
+
+unsigned int WorkStealingPool::GetQueueIndex() const
+{
+   if (t_pool == this)
+      return t_queueIndex;
+
+   return static_cast<unsigned int>(m_queues.size()) - 1;
+}
+
+bool WorkStealingPool::PopTask(unsigned int index, std::function<void()>& task)
+{
+   WorkerQueue& queue = *m_queues[index];
+   std::lock_guard<std::mutex> lock(queue.mutex);
+
+   if (queue.tasks.empty())
+      return false;
+
+   task = std::move(queue.tasks.back());
+   queue.tasks.pop_back();
+   --m_pendingTasks;
+
+   return true;
+}
+
+bool WorkStealingPool::StealTask(unsigned int thiefIndex, std::function<void()>& task)
+{
+   const size_t queueCount = m_queues.size();
+
+   for (size_t i = 1; i < queueCount; i++)
+   {
+      WorkerQueue& queue = *m_queues[(thiefIndex + i) % queueCount];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+
+      if (queue.tasks.empty())
+         continue;
+
+      task = std::move(queue.tasks.front());
+      queue.tasks.pop_front();
+      --m_pendingTasks;
+
+      return true;
+   }
+
+   return false;
+}
+#pragma endregion
+
+#pragma region TASK GROUP
+TaskGroup::TaskGroup(WorkStealingPool& pool) : m_pool(pool)
+{
+}
+
+TaskGroup::~TaskGroup()
+{
+   // Tasks reference the group, never leave them running
+   while (m_running > 0)
+   {
+      if (!m_pool.RunPendingTask())
+         std::this_thread::yield();
+   }
+}
+
+void TaskGroup::Run(std::function<void()> task)
+{
+   ++m_running;
+
+   m_pool.Submit([this, task = std::move(task)]()
+   {
+      try
+      {
+         task();
+      }
+      catch (...)
+      {
+         std::lock_guard<std::mutex> lock(m_exceptionMutex);
+         if (!m_exception)
+            m_exception = std::current_exception();
+      }
+
+      --m_running;
+   });
+}
+
+void TaskGroup::Wait()
+{
+   while (m_running > 0)
+   {
+      if (!m_pool.RunPendingTask())
+         std::this_thread::yield();
+   }
+
+   if (m_exception)
+   {
+      std::exception_ptr exception = m_exception;
+      m_exception = nullptr;
+      std::rethrow_exception(exception);
+   }
+}
+#pragma endregion
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fork/join thread pool.
+// Every worker owns a deque: it pushes and pops its own tasks at the back (LIFO, the freshest and smallest subtree first)
+// and steals from the front of the other deques (the oldest and biggest tasks) when it runs dry.
+// Threads outside the pool push into an extra shared deque, and help running tasks while they wait.
+class WorkStealingPool
+{
+public:
+   // 0 = one worker per hardware thread, the thread calling TaskGroup::Wait counts as one of them
+   explicit WorkStealingPool(unsigned int threadCount = 0);
+   ~WorkStealingPool();
+
+   WorkStealingPool(const WorkStealingPool&) = delete;
+   WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+   // Workers + the waiting thread
+   unsigned int GetThreadCount() const;
+
+   void Submit(std::function<void()> task);
+
+   // Runs one pending task from this thread's deque or stolen from another one, false if there was none
+   bool RunPendingTask();
+
+   // Splits [begin, end) in chunks of at least grainSize, runs function(chunkBegin, chunkEnd) on each and waits
+   void ParallelFor(size_t begin, size_t end, size_t grainSize, const std::function<void(size_t, size_t)>& function);
+
+private:
+   struct WorkerQueue
+   {
+      std::mutex mutex;
+      std::deque<std::function<void()>> tasks;
+   };
+
+   void WorkerLoop(unsigned int index);
+   unsigned int GetQueueIndex() const;
+   bool PopTask(unsigned int index, std::function<void()>& task);
+   bool StealTask(unsigned int thiefIndex, std::function<void()>& task);
+
+   // One deque per worker, the last one is shared by external threads
+   std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+   std::vector<std::thread> m_workers;
+
+   std::mutex m_sleepMutex;
+   std::condition_variable m_sleepCondition;
+   std::atomic<int> m_pendingTasks = 0;
+   std::atomic<bool> m_stop = false;
+};
+
+// Set of forked tasks that can be joined, exceptions thrown by a task are rethrown by Wait
+class TaskGroup
+{
+public:
+   explicit TaskGroup(WorkStealingPool& pool);
+   ~TaskGroup();
+
+   TaskGroup(const TaskGroup&) = delete;
+   TaskGroup& operator=(const TaskGroup&) = delete;
+
+   void Run(std::function<void()> task);
+
+   // Runs pending tasks (of any group) until every task of this group is done
+   void Wait();
+
+private:
+   WorkStealingPool& m_pool;
+   std::atomic<int> m_running = 0;
+
+   std::mutex m_exceptionMutex;
+   std::exception_ptr m_exception;
+};